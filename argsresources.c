@@ -28,8 +28,11 @@ static const char *ID = "$Id: argsresources.c,v 1.8 2006/04/07 03:22:39 grmcdorm
 static int setNumber(int *argc, char ***argv, void *arg, int value);
 static int setString(int *argc, char ***argv, void *arg, int value);
 static int setFlag(int *argc, char ***argv, void *arg, int value);
+static int addRegion(int *argc, char ***argv, void *arg, int value);
+static void parseRect(char *spec, CaptureRegion *region);
 
 static char * rect = NULL;
+static char * scale = NULL;
 
 typedef struct {
     const char *optionstring;
@@ -43,10 +46,12 @@ typedef struct {
 /* Options - excluding -listen, -tunnel, and -via */
 Options cmdLineOptions[] = {
   {"-allowblank",    setFlag,   &appData.ignoreBlank, 0, ": allow blank images"},
+  {"-bpp",           setNumber, &appData.bitsPerPixel, 0, " <BITS>: transmission pixel size (8: BGR233, 16: RGB565, 32: full colour)"},
   {"-compresslevel", setNumber, &appData.compressLevel, 0, " <COMPRESS-VALUE> (0..9: 0-fast, 9-best)"},
   {"-cursor",        setFlag,   &appData.useRemoteCursor, 1, ": include remote cursor"},
   {"-debug",         setFlag,   &appData.debug, 0, ": enable debug printout"},
   {"-encodings",     setString, &appData.encodingsString, 0, " <ENCODING-LIST> (e.g. \"tight copyrect\")"},
+  {"-grayscale",     setFlag,   &appData.grayscale, 1, ": save a grayscale image (implies -bpp 16 unless -bpp 8)"},
   {"-ignoreblank",   setFlag,   &appData.ignoreBlank, 1, ": ignore blank images"},
   {"-jpeg",          setFlag,   &appData.enableJPEG, 1, ": use JPEG transmission encoding"},
   {"-nocursor",      setFlag,   &appData.useRemoteCursor, 0, ": do not include remote cursor"},
@@ -55,11 +60,16 @@ Options cmdLineOptions[] = {
   {"-nullpasswd",      setFlag,   &appData.nullPassword, 1, ": force an empty password"},
   {"-quality",       setNumber, &appData.saveQuality, 0, " <JPEG-QUALITY-VALUE>: output file quality level, percent (0..100)"},
   {"-quiet",         setFlag,   &appData.quiet, 1, ": do not output messages"},
+  {"-record",        setFlag,   &appData.record, 1, ": record the session to the output file instead of saving snapshots"},
   {"-rect",          setString, &rect, 0, " wxh+x+y: define rectangle to capture (default entire screen)"},
+  {"-region",        addRegion, NULL, 0, " name:wxh+x+y: also capture this rectangle, to a file named after it"},
+  {"-scale",         setString, &scale, 0, " 1/2|1/4|1/8: save the image reduced by this factor"},
+  {"-sizes",         setString, &appData.outputSizes, 0, " <SIZE-LIST>: also save reduced copies (e.g. \"full 640w@q70 160w@q60\")"},
+  {"-tiled",         setFlag,   &appData.tiled, 1, ": keep the frame buffer in 64x64 tiles (faster for hextile, ZRLE and tight on large screens)"},
   {"-verbose",       setFlag,   &appData.quiet, 0, ": output messages"},
   {"-vncQuality",    setNumber, &appData.qualityLevel, 0, " <JPEG-QUALITY-VALUE>: transmission quality level (0..9: 0-low, 9-high)"},
   {"-fps",           setNumber, &appData.fps, 0, " <FPS>: Wait <FPS> seconds between snapshots, default 60"},
-  {"-count",         setNumber, &appData.count, 0, " <COUNT>: Capture <COUNT> images, default 1"},
+  {"-count",         setNumber, &appData.count, 0, " <COUNT>: Capture <COUNT> images, default 1; with -record, stop after <COUNT> keyframes, default at disconnect"},
   {NULL, NULL, NULL, 0}
 };
 
@@ -94,12 +104,15 @@ AppData appData = {
     100,    /* saveQuality */
     NULL,   /* outputFilename */
     0,      /* quiet */
-    0, 0,   /* rectXNegative, rectYNegative */
-    0, 0,   /* rect width, height */
-    0, 0,   /* rect x, y */
     0,      /* gotCursorPos (-cursor, -nocursor worked) */
     60,     /* fps */
-    1,      /* count */
+    -1,     /* count (1, or 0 with -record) */
+    32,     /* bitsPerPixel */
+    0,      /* grayscale */
+    1,      /* scale */
+    NULL,   /* outputSizes */
+    0,      /* tiled */
+    0,      /* record */
     };
 
 
@@ -144,7 +157,8 @@ usage(void)
         }
         if (cmdLineOptions[i].set == setFlag && *(Bool *)cmdLineOptions[i].arg) {
             fprintf(stderr, " (default)");
-        } else if (cmdLineOptions[i].set == setNumber) {
+        } else if (cmdLineOptions[i].set == setNumber &&
+                   *(int *)cmdLineOptions[i].arg >= 0) {
             fprintf(stderr, " (default %d)", *(int *)cmdLineOptions[i].arg);
         } else if (cmdLineOptions[i].set == setString) {
             char *str = *(char **)cmdLineOptions[i].arg;
@@ -194,51 +208,45 @@ GetArgsAndResources(int argc, char **argv)
       }
   } while (processed);
 
-    /* Parse rectangle provided. */
-    if (rect != NULL) {
-        /* We could use sscanf, but the return value is not consistent
-         * across all platforms.
-         */
-        long w, h;
-        long x, y;
-        char *end = NULL;
+    /* Parse rectangle provided; without it or -region, capture the
+     * whole screen. */
+    if (rect != NULL || numCaptureRegions == 0) {
+        CaptureRegion region;
 
-        w = strtol(rect, &end, 10);
-        if (end == NULL || end == rect || *end != 'x') {
-            fprintf(stderr, "%s: invalid rectangle specification %s\n",
-                    programName, rect);
-            usage();
-        }
-        end++;
-        h = strtol(end, &end, 10);
-        if (end == NULL || end == rect || (*end != '+' && *end != '-')) {
-            fprintf(stderr, "%s: invalid rectangle specification %s\n",
-                    programName, rect);
+        memset(&region, 0, sizeof(region));
+        if (rect != NULL)
+            parseRect(rect, &region);
+        if (!AddCaptureRegion(&region))
             usage();
-        }
-        /* determine sign */
-        appData.rectXNegative = *end == '-';
-        end++;
-        x = strtol(end, &end, 10);
-        if (end == NULL || end == rect || (*end != '+' && *end != '-')) {
-            fprintf(stderr, "%s: invalid rectangle specification %s\n",
-                    programName, rect);
-            usage();
-        }
-        /* determine sign */
-        appData.rectYNegative = *end == '-';
-        end++;
-        y = strtol(end, &end, 10);
-        if (end == NULL || end == rect || *end != '\0') {
-            fprintf(stderr, "%s: invalid rectangle specification %s\n",
-                    programName, rect);
+    }
+
+    /* Parse scale provided, 1/n or just n. */
+    if (scale != NULL) {
+        long n;
+        char *start = scale;
+        char *end = NULL;
+
+        if (strncmp(start, "1/", 2) == 0)
+            start += 2;
+        n = strtol(start, &end, 10);
+        if (end == start || *end != '\0' ||
+            (n != 1 && n != 2 && n != 4 && n != 8)) {
+            fprintf(stderr, "%s: invalid scale %s, must be 1/2, 1/4 or 1/8\n",
+                    programName, scale);
             usage();
         }
+        appData.scale = n;
+    }
 
-        appData.rectWidth = w;
-        appData.rectHeight = h;
-        appData.rectX = x;
-        appData.rectY = y;
+    /* A recording runs until the server disconnects unless -count says
+     * otherwise; snapshots stop after one. */
+    if (appData.count < 0)
+        appData.count = appData.record ? 0 : 1;
+
+    if (appData.bitsPerPixel != 8 && appData.bitsPerPixel != 16 &&
+        appData.bitsPerPixel != 32) {
+        fprintf(stderr, "%s: -bpp must be 8, 16 or 32\n", programName);
+        usage();
     }
 
     argc = argsleft;
@@ -334,6 +342,84 @@ static int setString(int *argc, char ***argv, void *arg, int value)
     return ok;
 }
 
+/*
+ * Parse a wxh+x+y rectangle. A '-' instead of '+' measures x or y from
+ * the right or bottom edge.
+ */
+static void parseRect(char *spec, CaptureRegion *region)
+{
+    /* We could use sscanf, but the return value is not consistent
+     * across all platforms.
+     */
+    long w, h;
+    long x, y;
+    char *end = NULL;
+
+    w = strtol(spec, &end, 10);
+    if (end == NULL || end == spec || *end != 'x') {
+        fprintf(stderr, "%s: invalid rectangle specification %s\n",
+                programName, spec);
+        usage();
+    }
+    end++;
+    h = strtol(end, &end, 10);
+    if (end == NULL || end == spec || (*end != '+' && *end != '-')) {
+        fprintf(stderr, "%s: invalid rectangle specification %s\n",
+                programName, spec);
+        usage();
+    }
+    /* determine sign */
+    region->xNegative = *end == '-';
+    end++;
+    x = strtol(end, &end, 10);
+    if (end == NULL || end == spec || (*end != '+' && *end != '-')) {
+        fprintf(stderr, "%s: invalid rectangle specification %s\n",
+                programName, spec);
+        usage();
+    }
+    /* determine sign */
+    region->yNegative = *end == '-';
+    end++;
+    y = strtol(end, &end, 10);
+    if (end == NULL || end == spec || *end != '\0') {
+        fprintf(stderr, "%s: invalid rectangle specification %s\n",
+                programName, spec);
+        usage();
+    }
+
+    region->width = w;
+    region->height = h;
+    region->x = x;
+    region->y = y;
+}
+
+/* -region name:wxh+x+y; may be given more than once. */
+static int addRegion(int *argc, char ***argv, void *arg, int value)
+{
+    CaptureRegion region;
+    char *colon;
+
+    if (*argc <= 2)
+        return 0;
+    (*argc) --;
+    (*argv)++;
+
+    memset(&region, 0, sizeof(region));
+    region.name = (*argv)[0];
+    colon = strchr(region.name, ':');
+    if (colon == NULL || colon == region.name ||
+        strcspn(region.name, "/\\") < (size_t)(colon - region.name)) {
+        fprintf(stderr, "%s: invalid region %s, expected name:wxh+x+y\n",
+                programName, region.name);
+        usage();
+    }
+    *colon = '\0';
+    parseRect(colon + 1, &region);
+    if (!AddCaptureRegion(&region))
+        usage();
+    return 1;
+}
+
 static int setFlag(int *argc, char ***argv, void *arg, int value)
 {
     *((Bool *)arg) = value;
@@ -31,8 +31,19 @@ static const char *ID = "$Id: buffer.c,v 1.6 2004/09/09 00:22:33 grmcdorman Exp
 #undef INT16
 
 static void BufferPixelToRGB(unsigned long pixel, int *r, int *g, int *b);
+static int BufferPixelToRaw(unsigned long pixel, CARD8 *raw);
+static void BuildPixelTables(void);
+static INLINE int ScaleSpan(int x, int w, int *first);
+static INLINE Bool StoredRect(int x, int y, int w, int h,
+                              int *fx, int *fy, int *nx, int *ny);
+static INLINE char *StoredPixel(int fx, int fy);
+static INLINE int StoredRun(int fx, int n);
+static void GetStoredRow(int fx, int fy, int n, char *dst);
+static void PutStoredRow(int fx, int fy, int n, const char *src);
 
 static char * rawBuffer = NULL;
+static unsigned long rawBufferBytes = 0;
+/* Also set by decoding threads; each only ever changes one way. */
 static char   bufferBlank = 1;
 static char   bufferWritten = 0;
 
@@ -40,12 +51,66 @@ static char   bufferWritten = 0;
 #define MY_BYTES_PER_PIXEL 4    /* size of pixel in VNC buffer */
 #define MY_BITS_PER_PIXEL (MY_BYTES_PER_PIXEL*8)
 
+/*
+ * With -grayscale the raw buffer holds one luma byte per pixel instead of
+ * packed RGB. Luma uses the same ITU-R BT.601 weights as the JPEG library.
+ */
+static int rawBytesPerPixel = RAW_BYTES_PER_PIXEL;
+
+/*
+ * With -scale the raw buffer holds every scale'th pixel of every scale'th
+ * row of the screen: stored pixel (X, Y) is screen pixel (X << scaleShift,
+ * Y << scaleShift). Every function here takes screen coordinates and
+ * writes only the stored pixels that fall inside its rectangle.
+ */
+static int scaleShift = 0;
+static int fbWidth, fbHeight;   /* size of the raw buffer in pixels */
+
+/*
+ * The raw buffer only holds the part of the screen covering the captured
+ * regions: stored pixel (fbX, fbY) is its first pixel. Anything written
+ * outside it is dropped.
+ */
+static int fbX, fbY;
+
+/*
+ * With -tiled the raw buffer is laid out in tiles of BUFFER_TILE x
+ * BUFFER_TILE stored pixels, each held row by row in one block, and the
+ * tiles row by row in turn. Tiles are counted from the screen origin, so
+ * that rectangles sent by the server usually start on a tile; (tileX,
+ * tileY) is the first tile held and tilesAcross the number in each row.
+ * A hextile or ZRLE tile then falls within a few kilobytes of memory,
+ * rather than across as many rows of a buffer that may be tens of
+ * megabytes wide.
+ */
+#define BUFFER_TILE_SHIFT 6
+#define BUFFER_TILE (1 << BUFFER_TILE_SHIFT)
+#define BUFFER_TILE_MASK (BUFFER_TILE - 1)
+
+static Bool tiledBuffer = False;
+static int tileX, tileY, tilesAcross;
+
+#define RGB_TO_GRAY(r, g, b) (((r) * 77 + (g) * 150 + (b) * 29 + 128) >> 8)
+
+/*
+ * With -bpp 8 or -bpp 16 the server sends BGR233 or RGB565 pixels. These
+ * tables expand them to the 8-bit components kept in the frame buffer:
+ * pixel8ToRGB by whole pixel, the others by component value.
+ */
+static CARD8 pixel8ToRGB[256][3];
+static CARD8 redToRGB[256], greenToRGB[256], blueToRGB[256];
+
+/* The same for -grayscale; the component tables hold weighted luma. */
+static CARD8 pixel8ToGray[256];
+static int redToGray[256], greenToGray[256], blueToGray[256];
+
 int
 AllocateBuffer()
 {
     unsigned long bytes;
     static const short testEndian = 1;
     int bigEndian;
+    int x, y, w, h;
 
     /* Determine 'endian' nature of this machine */
     /* On big-endian machines, the address of a short (16 bit) is the
@@ -61,116 +126,561 @@ AllocateBuffer()
     /* Format is RGBA. Due to the way we store the pixels,
      * the 'bigEndian' is the *opposite* of the hardware value.
      */
-    myFormat.bitsPerPixel = MY_BITS_PER_PIXEL;
-    myFormat.depth = 24;
     myFormat.trueColour = 1;
     myFormat.bigEndian = bigEndian;
-    if (bigEndian) {
-        myFormat.redShift = 24;
-        myFormat.greenShift = 16;
-        myFormat.blueShift = 8;
-    } else {
-        myFormat.redShift = 0;
-        myFormat.greenShift = 8;
-        myFormat.blueShift = 16;
+    /* Colour is thrown away in grayscale mode, so RGB565 carries enough
+     * luma; only 8 bits per pixel asks for less. */
+    if (appData.grayscale && appData.bitsPerPixel == 32)
+        appData.bitsPerPixel = 16;
+    switch (appData.bitsPerPixel) {
+    case 8:
+        /* BGR233 */
+        myFormat.bitsPerPixel = 8;
+        myFormat.depth = 8;
+        myFormat.redShift = MY_RED_SHIFT_8;
+        myFormat.greenShift = MY_GREEN_SHIFT_8;
+        myFormat.blueShift = MY_BLUE_SHIFT_8;
+        myFormat.redMax = MY_RED_MAX_8;
+        myFormat.greenMax = MY_GREEN_MAX_8;
+        myFormat.blueMax = MY_BLUE_MAX_8;
+        break;
+    case 16:
+        /* RGB565, in this machine's byte order */
+        myFormat.bitsPerPixel = 16;
+        myFormat.depth = 16;
+        myFormat.redShift = MY_RED_SHIFT_16;
+        myFormat.greenShift = MY_GREEN_SHIFT_16;
+        myFormat.blueShift = MY_BLUE_SHIFT_16;
+        myFormat.redMax = MY_RED_MAX_16;
+        myFormat.greenMax = MY_GREEN_MAX_16;
+        myFormat.blueMax = MY_BLUE_MAX_16;
+        break;
+    default:
+        /* The decoders rely on these bytes being red, green, blue and
+           padding in memory, which the shifts chosen at compile time only
+           give if MY_BIG_ENDIAN was right; the build fails if it cannot be
+           told, so this only catches a wrong -DMY_BIG_ENDIAN. */
+        if (bigEndian != MY_BIG_ENDIAN) {
+            fprintf(stderr, "%s: built with the wrong MY_BIG_ENDIAN\n",
+                    programName);
+            return 0;
+        }
+        myFormat.bitsPerPixel = MY_BITS_PER_PIXEL;
+        myFormat.depth = 24;
+        myFormat.redShift = MY_RED_SHIFT_32;
+        myFormat.greenShift = MY_GREEN_SHIFT_32;
+        myFormat.blueShift = MY_BLUE_SHIFT_32;
+        myFormat.redMax = MY_RED_MAX_32;
+        myFormat.greenMax = MY_GREEN_MAX_32;
+        myFormat.blueMax = MY_BLUE_MAX_32;
+        break;
     }
-    myFormat.redMax = 0xFF;
-    myFormat.greenMax = 0xFF;
-    myFormat.blueMax = 0xFF;
 
-    bytes = si.framebufferWidth * si.framebufferHeight * myFormat.depth / 8;
-    rawBuffer = malloc(bytes);   /* allocate initialized to 0 */
+    BuildPixelTables();
+
+    rawBytesPerPixel = appData.grayscale ? 1 : RAW_BYTES_PER_PIXEL;
+    for (scaleShift = 0; (1 << scaleShift) < appData.scale; scaleShift++)
+        ;
+    CaptureBounds(&x, &y, &w, &h);
+    fbWidth = ScaleSpan(x, w, &fbX);
+    fbHeight = ScaleSpan(y, h, &fbY);
+    tiledBuffer = appData.tiled;
+    if (tiledBuffer) {
+        int tilesDown;
+
+        tileX = fbX >> BUFFER_TILE_SHIFT;
+        tileY = fbY >> BUFFER_TILE_SHIFT;
+        tilesAcross = ((fbX + fbWidth + BUFFER_TILE_MASK) >> BUFFER_TILE_SHIFT) -
+                      tileX;
+        tilesDown = ((fbY + fbHeight + BUFFER_TILE_MASK) >> BUFFER_TILE_SHIFT) -
+                    tileY;
+        bytes = (unsigned long)tilesAcross * tilesDown *
+                BUFFER_TILE * BUFFER_TILE * rawBytesPerPixel;
+    } else {
+        bytes = (unsigned long)fbWidth * fbHeight * rawBytesPerPixel;
+    }
+    /* calloc() leaves the zero pages to the system, so only the parts of
+       the buffer that are written are ever touched. */
+    rawBuffer = calloc(bytes, 1);
     if (rawBuffer == NULL) {
         fprintf(stderr, "Failed to allocate memory frame buffer, %lu bytes\n",
                 bytes);
         return 0;
     }
-
-    memset(rawBuffer, 0xBA, bytes);
+    rawBufferBytes = bytes;
 
     return 1;
 }
 
+/*
+ * Fill in the expansion tables for myFormat. Component values are scaled
+ * to 0..255, so that the maximum becomes full intensity.
+ */
+static void
+BuildPixelTables(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        redToRGB[i] = ((i & myFormat.redMax) * 255 + myFormat.redMax / 2) /
+                      myFormat.redMax;
+        greenToRGB[i] = ((i & myFormat.greenMax) * 255 +
+                         myFormat.greenMax / 2) / myFormat.greenMax;
+        blueToRGB[i] = ((i & myFormat.blueMax) * 255 +
+                        myFormat.blueMax / 2) / myFormat.blueMax;
+    }
+    for (i = 0; i < 256; i++) {
+        pixel8ToRGB[i][0] = redToRGB[(i >> myFormat.redShift) & 0xFF];
+        pixel8ToRGB[i][1] = greenToRGB[(i >> myFormat.greenShift) & 0xFF];
+        pixel8ToRGB[i][2] = blueToRGB[(i >> myFormat.blueShift) & 0xFF];
+        pixel8ToGray[i] = RGB_TO_GRAY(pixel8ToRGB[i][0], pixel8ToRGB[i][1],
+                                      pixel8ToRGB[i][2]);
+        redToGray[i] = redToRGB[i] * 77;
+        greenToGray[i] = greenToRGB[i] * 150;
+        blueToGray[i] = blueToRGB[i] * 29 + 128;
+    }
+}
+
+/*
+ * Find the stored pixels covering screen pixels x .. x+w-1 along one axis:
+ * sets *first to the first of them and returns how many there are.
+ */
+static INLINE int
+ScaleSpan(int x, int w, int *first)
+{
+    int round = (1 << scaleShift) - 1;
+
+    *first = (x + round) >> scaleShift;
+    return ((x + w + round) >> scaleShift) - *first;
+}
+
+/*
+ * Find the stored pixels of a screen rectangle that the raw buffer holds:
+ * sets the first of them, counted from the screen origin, and how many
+ * there are across and down. Returns False if there are none.
+ */
+static INLINE Bool
+StoredRect(int x, int y, int w, int h, int *fx, int *fy, int *nx, int *ny)
+{
+    *nx = ScaleSpan(x, w, fx);
+    *ny = ScaleSpan(y, h, fy);
+    if (*fx < fbX) {
+        *nx -= fbX - *fx;
+        *fx = fbX;
+    }
+    if (*fy < fbY) {
+        *ny -= fbY - *fy;
+        *fy = fbY;
+    }
+    if (*nx > fbX + fbWidth - *fx)
+        *nx = fbX + fbWidth - *fx;
+    if (*ny > fbY + fbHeight - *fy)
+        *ny = fbY + fbHeight - *fy;
+    return *nx > 0 && *ny > 0;
+}
+
+/* Address of a stored pixel held in the raw buffer. */
+static INLINE char *
+StoredPixel(int fx, int fy)
+{
+    if (tiledBuffer) {
+        long tile = ((fy >> BUFFER_TILE_SHIFT) - tileY) * (long)tilesAcross +
+                    (fx >> BUFFER_TILE_SHIFT) - tileX;
+
+        return rawBuffer +
+               ((tile << (2 * BUFFER_TILE_SHIFT)) +
+                ((fy & BUFFER_TILE_MASK) << BUFFER_TILE_SHIFT) +
+                (fx & BUFFER_TILE_MASK)) * rawBytesPerPixel;
+    }
+    return rawBuffer + ((fx - fbX) + (fy - fbY) * fbWidth) * rawBytesPerPixel;
+}
+
+/*
+ * How many of the n stored pixels along a row from stored column fx follow
+ * each other in the raw buffer: all of them, unless it is tiled.
+ */
+static INLINE int
+StoredRun(int fx, int n)
+{
+    int left;
+
+    if (!tiledBuffer)
+        return n;
+    left = BUFFER_TILE - (fx & BUFFER_TILE_MASK);
+    return n < left ? n : left;
+}
+
+/* Copy n stored pixels of a row out of the raw buffer, or into it. */
+static void
+GetStoredRow(int fx, int fy, int n, char *dst)
+{
+    int col, run;
+
+    for (col = 0; col < n; col += run) {
+        run = StoredRun(fx + col, n - col);
+        memcpy(dst + col * rawBytesPerPixel, StoredPixel(fx + col, fy),
+               run * rawBytesPerPixel);
+    }
+}
+
+static void
+PutStoredRow(int fx, int fy, int n, const char *src)
+{
+    int col, run;
+
+    for (col = 0; col < n; col += run) {
+        run = StoredRun(fx + col, n - col);
+        memcpy(StoredPixel(fx + col, fy), src + col * rawBytesPerPixel,
+               run * rawBytesPerPixel);
+    }
+}
+
+/*
+ * Convert n pixels in myFormat, taking every step'th one from src, into
+ * stored pixels at dst. 8 and 16 bit pixels are expanded with the lookup
+ * tables.
+ */
+static void
+ConvertRow(const CARD8 *src, int step, int n, char *dst)
+{
+    int col;
+    CARD16 pixel;
+
+    switch (myFormat.bitsPerPixel) {
+    case 8:
+        if (rawBytesPerPixel == 1) {
+            for (col = 0; col < n; col++, src += step)
+                dst[col] = pixel8ToGray[*src];
+        } else {
+            for (col = 0; col < n; col++, src += step) {
+                const CARD8 *rgb = pixel8ToRGB[*src];
+                dst[0] = rgb[0];
+                dst[1] = rgb[1];
+                dst[2] = rgb[2];
+                dst += RAW_BYTES_PER_PIXEL;
+            }
+        }
+        break;
+    case 16:
+        for (col = 0; col < n; col++, src += step * 2) {
+            memcpy(&pixel, src, 2);
+            if (rawBytesPerPixel == 1) {
+                dst[col] = (redToGray[(pixel >> MY_RED_SHIFT_16) & 0xFF] +
+                            greenToGray[(pixel >> MY_GREEN_SHIFT_16) & 0xFF] +
+                            blueToGray[(pixel >> MY_BLUE_SHIFT_16) & 0xFF])
+                           >> 8;
+            } else {
+                dst[0] = redToRGB[(pixel >> MY_RED_SHIFT_16) & 0xFF];
+                dst[1] = greenToRGB[(pixel >> MY_GREEN_SHIFT_16) & 0xFF];
+                dst[2] = blueToRGB[(pixel >> MY_BLUE_SHIFT_16) & 0xFF];
+                dst += RAW_BYTES_PER_PIXEL;
+            }
+        }
+        break;
+    default:
+        /* Bytes in memory are red, green, blue and padding. */
+        if (rawBytesPerPixel == 1) {
+            for (col = 0; col < n; col++, src += step * MY_BYTES_PER_PIXEL)
+                dst[col] = RGB_TO_GRAY(src[0], src[1], src[2]);
+        } else {
+            for (col = 0; col < n; col++, src += step * MY_BYTES_PER_PIXEL) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                dst += RAW_BYTES_PER_PIXEL;
+            }
+        }
+        break;
+    }
+}
+
+/* Convert n pixels in myFormat to stored pixels, for the cursor. */
 void
-CopyDataToScreen(char *buffer, int x, int y, int w, int h)
+ConvertToBufferPixels(const char *src, int n, char *dst)
 {
-    int start;
-    int stride;
-    int row, col;
-    stride = si.framebufferWidth * RAW_BYTES_PER_PIXEL - w * RAW_BYTES_PER_PIXEL;
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+    ConvertRow((const CARD8 *)src, 1, n, dst);
+}
+
+/* Note that stored pixels have been written, and whether any is not black. */
+static void
+StoredAreaWritten(int fx, int fy, int nx, int ny)
+{
+    char *row;
+    int r, col, x, run;
 
     bufferWritten = 1;
 
-    for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            bufferBlank &= (buffer[0] == 0 &&
-                           buffer[1] == 0 &&
-                           buffer[2] == 0);
-            rawBuffer[start++] = *buffer++;
-            rawBuffer[start++] = *buffer++;
-            rawBuffer[start++] = *buffer++;
-            buffer++;   /* ignore 4th byte */
+    for (x = 0; x < nx && bufferBlank; x += run) {
+        run = StoredRun(fx + x, nx - x);
+        for (r = 0; r < ny && bufferBlank; r++) {
+            row = StoredPixel(fx + x, fy + r);
+            for (col = 0; col < run * rawBytesPerPixel; col++) {
+                if (row[col]) {
+                    bufferBlank = 0;
+                    break;
+                }
+            }
         }
-        start += stride;
     }
 }
 
-char *
-CopyScreenToData(int x, int y, int w, int h)
+/* Store a rectangle of pixels in myFormat. */
+void
+CopyDataToScreen(char *buffer, int x, int y, int w, int h)
 {
-    int start;
-    int stride;
-    int row, col;
-    char *buffer;
-    char *cp;
+    const CARD8 *src;
+    int bytesPerPixel = myFormat.bitsPerPixel / 8;
+    int fx, fy, nx, ny, row, col, run;
+
+    if (!StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        return;
 
-    stride = si.framebufferWidth * RAW_BYTES_PER_PIXEL - w * RAW_BYTES_PER_PIXEL;
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+    /* A column of tiles at a time, so that each is finished in turn. */
+    for (col = 0; col < nx; col += run) {
+        run = StoredRun(fx + col, nx - col);
+        src = (const CARD8 *)buffer +
+              (((fy << scaleShift) - y) * w + ((fx + col) << scaleShift) - x) *
+              bytesPerPixel;
+        for (row = 0; row < ny; row++) {
+            ConvertRow(src, 1 << scaleShift, run,
+                       StoredPixel(fx + col, fy + row));
+            src += (w << scaleShift) * bytesPerPixel;
+        }
+    }
+    StoredAreaWritten(fx, fy, nx, ny);
+}
+
+/*
+ * The same for a rectangle that has already been reduced by the -scale
+ * factor: buffer holds one pixel for each scale x scale block of the
+ * rectangle, starting at (x, y), and rows of (w + scale - 1) / scale
+ * pixels. Without -scale this is CopyDataToScreen().
+ */
+void
+CopyScaledDataToScreen(char *buffer, int x, int y, int w, int h)
+{
+    int bytesPerPixel = myFormat.bitsPerPixel / 8;
+    int fx, fy, nx, ny, row, col, run, bytesPerRow, firstX, firstY;
+    const CARD8 *src;
 
+    bytesPerRow = ScaleSpan(0, w, &fx) * bytesPerPixel;
 
-    /* Allocate a buffer at the VNC size, not the raw size */
-    buffer = malloc(h * w * MY_BYTES_PER_PIXEL);
-    cp = buffer;
+    ScaleSpan(x, w, &firstX);
+    ScaleSpan(y, h, &firstY);
+    if (!StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        return;
 
-    for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = 0;
+    for (col = 0; col < nx; col += run) {
+        run = StoredRun(fx + col, nx - col);
+        src = (const CARD8 *)buffer + (fy - firstY) * bytesPerRow +
+              (fx + col - firstX) * bytesPerPixel;
+        for (row = 0; row < ny; row++) {
+            ConvertRow(src + row * bytesPerRow, 1, run,
+                       StoredPixel(fx + col, fy + row));
         }
-        start += stride;
     }
+    StoredAreaWritten(fx, fy, nx, ny);
+}
+
+/*
+ * Decoders whose output is already packed RGB can write it straight into
+ * the frame buffer. DirectBufferRect() returns the address of pixel (x, y)
+ * and the distance in bytes between rows, or NULL if the rectangle has to
+ * go through CopyDataToScreen() instead, as it always does in grayscale
+ * or scaled mode. A tiled buffer only gives out rectangles within one tile,
+ * so decoders of tiles try each of their tiles in turn.
+ * DirectBufferWritten() must be called once the rows have been filled in.
+ */
+char *
+DirectBufferRect(int x, int y, int w, int h, int *stride)
+{
+    if (rawBytesPerPixel != RAW_BYTES_PER_PIXEL || scaleShift != 0)
+        return NULL;
+    if (x < fbX || y < fbY || w < 0 || h < 0 ||
+        x + w > fbX + fbWidth || y + h > fbY + fbHeight) {
+        return NULL;
+    }
+
+    if (tiledBuffer) {
+        if (w == 0 || h == 0 ||
+            (x >> BUFFER_TILE_SHIFT) != ((x + w - 1) >> BUFFER_TILE_SHIFT) ||
+            (y >> BUFFER_TILE_SHIFT) != ((y + h - 1) >> BUFFER_TILE_SHIFT))
+            return NULL;
+        *stride = BUFFER_TILE * RAW_BYTES_PER_PIXEL;
+    } else {
+        *stride = fbWidth * RAW_BYTES_PER_PIXEL;
+    }
+    return StoredPixel(x, y);
+}
+
+void
+DirectBufferWritten(int x, int y, int w, int h)
+{
+    int fx, fy, nx, ny;
+
+    if (StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        StoredAreaWritten(fx, fy, nx, ny);
+}
 
-    return buffer;
+/*
+ * CopyRect: move a rectangle within the frame buffer. Rows are copied in
+ * the order that leaves overlapping source rows intact. When scaled, a
+ * source that is not a whole number of stored pixels away is taken from
+ * the nearest stored pixels above and to the left. Pixels whose source is
+ * not held in the raw buffer are left alone. In a tiled buffer the rows
+ * are not contiguous, so each is copied through a row of its own.
+ */
+void
+CopyBufferRect(int srcX, int srcY, int x, int y, int w, int h)
+{
+    int row, first, last, step;
+    int fx, fy, nx, ny, sx, sy;
+    char *rowBuffer = NULL;
+
+    if (!StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        return;
+    sx = (srcX + (fx << scaleShift) - x) >> scaleShift;
+    sy = (srcY + (fy << scaleShift) - y) >> scaleShift;
+    if (sx < fbX) {
+        nx -= fbX - sx;
+        fx += fbX - sx;
+        sx = fbX;
+    }
+    if (sy < fbY) {
+        ny -= fbY - sy;
+        fy += fbY - sy;
+        sy = fbY;
+    }
+    if (nx > fbX + fbWidth - sx)
+        nx = fbX + fbWidth - sx;
+    if (ny > fbY + fbHeight - sy)
+        ny = fbY + fbHeight - sy;
+    if (nx <= 0 || ny <= 0)
+        return;
+
+    if (fy <= sy) {
+        first = 0;
+        last = ny;
+        step = 1;
+    } else {
+        first = ny - 1;
+        last = -1;
+        step = -1;
+    }
+    if (tiledBuffer) {
+        rowBuffer = malloc(nx * rawBytesPerPixel);
+        if (rowBuffer == NULL) {
+            fprintf(stderr, "CopyRect: out of memory\n");
+            return;
+        }
+    }
+    for (row = first; row != last; row += step) {
+        if (rowBuffer != NULL) {
+            GetStoredRow(sx, sy + row, nx, rowBuffer);
+            PutStoredRow(fx, fy + row, nx, rowBuffer);
+        } else {
+            memmove(StoredPixel(fx, fy + row), StoredPixel(sx, sy + row),
+                    nx * rawBytesPerPixel);
+        }
+    }
+    free(rowBuffer);
+    StoredAreaWritten(fx, fy, nx, ny);
 }
 
 void
 FillBufferRectangle(int x, int y, int w, int h, unsigned long pixel)
 {
-    int r, g, b;
-    int start;
-    int stride;
-    int row, col;
+    CARD8 raw[RAW_BYTES_PER_PIXEL];
+    int fx, fy, nx, ny;
+    int row, col, x0, run;
+    char *dst;
 
-    BufferPixelToRGB(pixel, &r, &g, &b);
+    if (!StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        return;
 
-    bufferBlank &= (r == 0 && g == 0 && b == 0);
+    BufferPixelToRaw(pixel, raw);
+    if (raw[0] || (rawBytesPerPixel > 1 && (raw[1] || raw[2])))
+        bufferBlank = 0;
     bufferWritten = 1;
 
-    stride = si.framebufferWidth * RAW_BYTES_PER_PIXEL - w * RAW_BYTES_PER_PIXEL;
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
-    for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            rawBuffer[start++] = r;
-            rawBuffer[start++] = g;
-            rawBuffer[start++] = b;
+    for (x0 = 0; x0 < nx; x0 += run) {
+        run = StoredRun(fx + x0, nx - x0);
+        for (row = 0; row < ny; row++) {
+            dst = StoredPixel(fx + x0, fy + row);
+            if (rawBytesPerPixel == 1) {
+                memset(dst, raw[0], run);
+            } else {
+                for (col = 0; col < run; col++) {
+                    *dst++ = raw[0];
+                    *dst++ = raw[1];
+                    *dst++ = raw[2];
+                }
+            }
         }
-        start += stride;
     }
 }
 
+/*
+ * Paint a list of subrectangles of the rectangle at (rx, ry), clipping
+ * them to it. Each colour is converted once and laid out as a row of
+ * packed pixels, which is then copied into every row of the subrectangles
+ * using it; consecutive subrectangles often share a colour.
+ */
+#define FILL_PATTERN_PIXELS 256
+
+void
+FillBufferSubrects(int rx, int ry, int rw, int rh,
+                   const BufferSubrect *subrects, int n)
+{
+    char pattern[FILL_PATTERN_PIXELS * RAW_BYTES_PER_PIXEL];
+    int patternPixels = 0;
+    unsigned long pixel = 0;
+    int bpp = rawBytesPerPixel;
+    CARD8 raw[RAW_BYTES_PER_PIXEL];
+    int i, k, row, x, w, h, len, fx, fy;
+
+    for (i = 0; i < n; i++) {
+        x = subrects[i].x;
+        w = subrects[i].w;
+        h = subrects[i].h;
+        if (x < 0 || subrects[i].y < 0 || x >= rw || subrects[i].y >= rh)
+            continue;
+        if (w > rw - x)
+            w = rw - x;
+        if (h > rh - subrects[i].y)
+            h = rh - subrects[i].y;
+        if (!StoredRect(rx + x, ry + subrects[i].y, w, h, &fx, &fy, &w, &h))
+            continue;
+
+        if (patternPixels == 0 || subrects[i].pixel != pixel) {
+            pixel = subrects[i].pixel;
+            BufferPixelToRaw(pixel, raw);
+            for (k = 0; k < bpp; k++) {
+                if (raw[k])
+                    bufferBlank = 0;
+            }
+            patternPixels = 0;
+        }
+        /* Lay out as much of the pattern as this subrectangle needs. */
+        while (patternPixels < w && patternPixels < FILL_PATTERN_PIXELS) {
+            memcpy(&pattern[patternPixels * bpp], raw, bpp);
+            patternPixels++;
+        }
+
+        for (row = 0; row < h; row++) {
+            for (x = 0; x < w; x += len) {
+                len = StoredRun(fx + x, w - x);
+                if (len > FILL_PATTERN_PIXELS)
+                    len = FILL_PATTERN_PIXELS;
+                memcpy(StoredPixel(fx + x, fy + row), pattern, len * bpp);
+            }
+        }
+    }
+
+    if (n > 0)
+        bufferWritten = 1;
+}
+
 int
 BufferIsBlank()
 {
@@ -183,12 +693,274 @@ BufferWritten()
     return bufferWritten;
 }
 
+/*
+ * Stored pixels of a screen rectangle, for code that reads the frame
+ * buffer directly: returns the address of its first pixel and sets the
+ * distance in bytes between rows and its size in stored pixels. The
+ * frame buffer never holds the cursor, so if it is to be drawn over the
+ * rectangle NULL is returned, as it is for a tiled buffer, which has no
+ * such rows. GetBufferRows() then copies them out instead, with the
+ * cursor, to rows stride bytes apart at dst.
+ * BufferComponents() is the number of bytes per pixel, 3 for RGB or 1
+ * for grayscale.
+ */
+char *
+BufferRectPixels(int x, int y, int w, int h, int *stride,
+                 int *width, int *height)
+{
+    int fx, fy, cx, cy, cw, ch;
+
+    if (!StoredRect(x, y, w, h, &fx, &fy, width, height))
+        *width = *height = 0;
+    *stride = fbWidth * rawBytesPerPixel;
+    if (tiledBuffer)
+        return NULL;
+    if (CursorRect(&cx, &cy, &cw, &ch) &&
+        cx < x + w && x < cx + cw && cy < y + h && y < cy + ch)
+        return NULL;
+    return StoredPixel(fx, fy);
+}
+
+void
+GetBufferRows(int x, int y, int w, int h, char *dst, int stride)
+{
+    int fx, fy, nx, ny, row;
+
+    if (!StoredRect(x, y, w, h, &fx, &fy, &nx, &ny))
+        return;
+    for (row = 0; row < ny; row++)
+        GetStoredRow(fx, fy + row, nx, dst + row * stride);
+    DrawCursor(dst, stride, fx, fy, nx, ny);
+}
+
+int
+BufferComponents(void)
+{
+    return rawBytesPerPixel;
+}
+
+/*
+ * The whole frame buffer, as rows of stored pixels without the cursor, in
+ * the same layout whether or not it is tiled: StoredBufferSize() gives its
+ * size in stored pixels, GetStoredBufferRow() copies one row out and
+ * PutStoredBufferRow() copies one back in.
+ */
+void
+StoredBufferSize(int *width, int *height)
+{
+    *width = fbWidth;
+    *height = fbHeight;
+}
+
+void
+GetStoredBufferRow(int row, char *dst)
+{
+    GetStoredRow(fbX, fbY + row, fbWidth, dst);
+}
+
+void
+PutStoredBufferRow(int row, const char *src)
+{
+    PutStoredRow(fbX, fbY + row, fbWidth, src);
+    StoredAreaWritten(fbX, fbY + row, fbWidth, 1);
+}
+
+/*
+ * A copy of the frame buffer, for replay checkpoints: SaveBufferState()
+ * makes one, RestoreBufferState() copies it back and FreeBufferState()
+ * frees it.
+ */
+typedef struct {
+    char blank, written;
+    char *pixels;
+} BufferState;
+
+void *
+SaveBufferState(void)
+{
+    BufferState *state = (BufferState *) malloc(sizeof(BufferState));
+
+    if (state == NULL)
+        return NULL;
+    state->pixels = malloc(rawBufferBytes ? rawBufferBytes : 1);
+    if (state->pixels == NULL) {
+        free(state);
+        return NULL;
+    }
+    memcpy(state->pixels, rawBuffer, rawBufferBytes);
+    state->blank = bufferBlank;
+    state->written = bufferWritten;
+    return state;
+}
+
+void
+RestoreBufferState(void *saved)
+{
+    BufferState *state = (BufferState *) saved;
+
+    memcpy(rawBuffer, state->pixels, rawBufferBytes);
+    bufferBlank = state->blank;
+    bufferWritten = state->written;
+}
+
+void
+FreeBufferState(void *saved)
+{
+    BufferState *state = (BufferState *) saved;
+
+    free(state->pixels);
+    free(state);
+}
+
+/*
+ * Scanlines for the JPEG library: a JpegRowsProc points rows[] at up to
+ * max rows of the image from row on, and returns how many it gave.
+ */
+typedef int (*JpegRowsProc)(void *arg, int row, JSAMPROW *rows, int max);
+
+typedef struct {
+  char *pixels;
+  int stride;
+} LinearRows;
+
+/*
+ * The rows of the frame buffer being saved, fx, fy, nx and ny in stored
+ * pixels. A linear buffer's rows are used where they are, except for
+ * those the cursor is drawn over; those, and a tiled buffer's rows, are
+ * copied into band first.
+ */
+typedef struct {
+  int fx, fy, nx, ny;
+  char *pixels;		/* the first pixel of a linear buffer, or NULL */
+  int stride;
+  int cursorY, cursorH;	/* the stored rows the cursor is drawn over */
+  char *band;		/* JPEG_ROWS rows of nx stored pixels */
+} SnapshotRows;
+
+#define JPEG_ROWS BUFFER_TILE
+
+static void write_JPEG_rows (char * filename, int quality, int components,
+                             int width, int height, JpegRowsProc getRows,
+                             void *arg);
+
+static int
+GetLinearRows(void *arg, int row, JSAMPROW *rows, int max)
+{
+  LinearRows *image = (LinearRows *) arg;
+  int n;
+
+  for (n = 0; n < max; n++)
+    rows[n] = (JSAMPROW) &image->pixels[(row + n) * image->stride];
+  return n;
+}
+
+/*
+ * Rows of a linear buffer are given where they are, up to the cursor; the
+ * rows it is drawn over are copied into the band. A tiled buffer gives the
+ * rest of the row of tiles holding row, copied into the band: each row of
+ * a tile is one copy, and the tiles are read while the JPEG library
+ * encodes the band, so the image is never laid out in full. The cursor is
+ * drawn over the band, never the frame buffer.
+ */
+static int
+GetSnapshotRows(void *arg, int row, JSAMPROW *rows, int max)
+{
+  SnapshotRows *image = (SnapshotRows *) arg;
+  int y = image->fy + row, n, i;
+  int rowBytes = image->nx * rawBytesPerPixel;
+
+  if (image->pixels != NULL) {
+    /* Rows above or below the cursor. */
+    if (y < image->cursorY)
+      n = image->cursorY - y;
+    else if (y >= image->cursorY + image->cursorH)
+      n = max;
+    else
+      n = 0;
+    if (n > 0) {
+      if (n > max)
+        n = max;
+      for (i = 0; i < n; i++)
+        rows[i] = (JSAMPROW) &image->pixels[(row + i) * image->stride];
+      return n;
+    }
+    n = image->cursorY + image->cursorH - y;
+  } else {
+    n = BUFFER_TILE - (y & BUFFER_TILE_MASK);
+  }
+  if (n > max)
+    n = max;
+
+  for (i = 0; i < n; i++) {
+    rows[i] = (JSAMPROW) &image->band[i * rowBytes];
+    GetStoredRow(image->fx, y + i, image->nx, image->band + i * rowBytes);
+  }
+  DrawCursor(image->band, rowBytes, image->fx, y, image->nx, n);
+  return n;
+}
+
+/*
+ * VNCSNAPSHOT: the rectangle is given in screen coordinates and is written
+ * straight out of the frame buffer, reduced by -scale if that was given.
+ */
+void
+write_JPEG_file (char * filename, int quality, int x, int y, int width, int height)
+{
+  SnapshotRows image;
+  int cx, cy, cw, ch;
+
+  if (!StoredRect(x, y, width, height, &image.fx, &image.fy, &image.nx,
+                  &image.ny))
+    image.fx = image.fy = image.nx = image.ny = 0;
+
+  image.pixels = NULL;
+  image.stride = fbWidth * rawBytesPerPixel;
+  if (!tiledBuffer)
+    image.pixels = StoredPixel(image.fx, image.fy);
+
+  image.cursorY = image.cursorH = 0;
+  if (CursorRect(&cx, &cy, &cw, &ch))
+    image.cursorH = ScaleSpan(cy, ch, &image.cursorY);
+
+  image.band = NULL;
+  if (image.pixels == NULL || image.cursorH > 0) {
+    image.band = malloc((size_t)image.nx * JPEG_ROWS * rawBytesPerPixel + 1);
+    if (image.band == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      exit(1);
+    }
+  }
+  write_JPEG_rows(filename, quality, rawBytesPerPixel, image.nx, image.ny,
+                  GetSnapshotRows, &image);
+  free(image.band);
+}
+
+/*
+ * VNCSNAPSHOT: writes width x height pixels of components bytes each (3 for
+ * RGB, 1 for grayscale), starting at pixels with rows stride bytes apart.
+ * Several images may be written at once from different threads.
+ */
+void
+write_JPEG_image (char * filename, int quality, char *pixels, int stride,
+                  int components, int width, int height)
+{
+  LinearRows linear;
+
+  linear.pixels = pixels;
+  linear.stride = stride;
+  write_JPEG_rows(filename, quality, components, width, height,
+                  GetLinearRows, &linear);
+}
+
 /*
  * Borrowed with very minor modifications from JPEG6 sample code. Error handling
  * remains as default (i.e. exit on errors).
+ *
+ * VNCSNAPSHOT: the scanlines come from getRows.
  */
-void
-write_JPEG_file (char * filename, int quality, int width, int height)
+static void
+write_JPEG_rows (char * filename, int quality, int components,
+                 int width, int height, JpegRowsProc getRows, void *arg)
 {
   /* This struct contains the JPEG compression parameters and pointers to
    * working space (which is allocated as needed by the JPEG library).
@@ -208,8 +980,8 @@ write_JPEG_file (char * filename, int quality, int width, int height)
   struct jpeg_error_mgr jerr;
   /* More stuff */
   FILE * outfile;		/* target file */
-  JSAMPROW row_pointer[1];	/* pointer to JSAMPLE row[s] */
-  int row_stride;		/* physical row width in image buffer */
+  JSAMPROW row_pointer[JPEG_ROWS];	/* pointer to JSAMPLE row[s] */
+  int rows;
 
   /* Step 1: allocate and initialize JPEG compression object */
 
@@ -247,8 +1019,8 @@ write_JPEG_file (char * filename, int quality, int width, int height)
    */
   cinfo.image_width = width; 	/* image width and height, in pixels */
   cinfo.image_height = height;
-  cinfo.input_components = RAW_BYTES_PER_PIXEL;		/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
+  cinfo.input_components = components;		/* # of color components per pixel */
+  cinfo.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB; 	/* colorspace of input image */
   /* Now use the library's routine to set default compression parameters.
    * (You must set at least cinfo.in_color_space before calling this,
    * since the defaults depend on the source color space.)
@@ -262,8 +1034,9 @@ write_JPEG_file (char * filename, int quality, int width, int height)
 
     /* VNCSNAPSHOT: Set file colourspace to RGB.
      *   If it is not set to RGB, colour distortions occur.
+     *   Grayscale snapshots are written with a single component.
      */
-  jpeg_set_colorspace(&cinfo, JCS_RGB);
+  jpeg_set_colorspace(&cinfo, cinfo.in_color_space);
 
   /* Step 4: Start compressor */
 
@@ -277,18 +1050,14 @@ write_JPEG_file (char * filename, int quality, int width, int height)
 
   /* Here we use the library's state variable cinfo.next_scanline as the
    * loop counter, so that we don't have to keep track ourselves.
-   * To keep things simple, we pass one scanline per call; you can pass
-   * more if you wish, though.
+   * We pass as many scanlines per call as getRows gives, up to JPEG_ROWS.
    */
-  row_stride = width * 3;	/* JSAMPLEs per row in image_buffer */
-
   while (cinfo.next_scanline < cinfo.image_height) {
-    /* jpeg_write_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could pass
-     * more than one scanline at a time if that's more convenient.
-     */
-    row_pointer[0] = & rawBuffer[cinfo.next_scanline * row_stride];
-    (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    rows = cinfo.image_height - cinfo.next_scanline;
+    if (rows > JPEG_ROWS)
+      rows = JPEG_ROWS;
+    rows = getRows(arg, cinfo.next_scanline, row_pointer, rows);
+    (void) jpeg_write_scanlines(&cinfo, row_pointer, rows);
   }
 
   /* Step 6: Finish compression */
@@ -310,47 +1079,30 @@ write_JPEG_file (char * filename, int quality, int width, int height)
 static void
 BufferPixelToRGB(unsigned long pixel, int *r, int *g, int *b)
 {
-    *r = (pixel >> myFormat.redShift) & myFormat.redMax;
-    *b = (pixel >> myFormat.blueShift) & myFormat.blueMax;
-    *g = (pixel >> myFormat.greenShift) & myFormat.greenMax;
-}
-
-void
-ShrinkBuffer(long x, long y, long req_width, long req_height)
-{
-    int start;
-    int stride;
-    int row, col;
-    char *cp;
-
-
-    /*
-     * Don't bother if x and y are zero and the width is the same.
-     */
-    if (x == 0 && y == 0 && req_width == si.framebufferWidth) {
+    if (myFormat.bitsPerPixel == MY_BITS_PER_PIXEL) {
+        *r = (pixel >> MY_RED_SHIFT_32) & 0xFF;
+        *g = (pixel >> MY_GREEN_SHIFT_32) & 0xFF;
+        *b = (pixel >> MY_BLUE_SHIFT_32) & 0xFF;
         return;
     }
+    *r = redToRGB[(pixel >> myFormat.redShift) & 0xFF];
+    *g = greenToRGB[(pixel >> myFormat.greenShift) & 0xFF];
+    *b = blueToRGB[(pixel >> myFormat.blueShift) & 0xFF];
+}
 
-    /*
-     * Rather than creating a copy, we just move in-place. Since we are
-     * doing this from the start of the image, there is no problem
-     * with overlapping moves.
-     */
-
-    stride = si.framebufferWidth * RAW_BYTES_PER_PIXEL - req_width * RAW_BYTES_PER_PIXEL;
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
-
-
-    cp = rawBuffer;
+/* Convert a pixel to the bytes stored for it; returns how many there are. */
+static int
+BufferPixelToRaw(unsigned long pixel, CARD8 *raw)
+{
+    int r, g, b;
 
-    for (row = 0; row < req_height; row++) {
-        for (col = 0; col < req_width; col++) {
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-        }
-        start += stride;
+    BufferPixelToRGB(pixel, &r, &g, &b);
+    if (rawBytesPerPixel == 1) {
+        raw[0] = RGB_TO_GRAY(r, g, b);
+        return 1;
     }
-    
+    raw[0] = r;
+    raw[1] = g;
+    raw[2] = b;
+    return RAW_BYTES_PER_PIXEL;
 }
-  
@@ -26,9 +26,6 @@ static const char *ID = "$Id: cursor.c,v 1.5 2004/09/09 00:22:33 grmcdorman Exp
 #include <vncsnapshot.h>
 
 
-#define OPER_SAVE     0
-#define OPER_RESTORE  1
-
 #define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
    ((((CARD##bpp)(r) & 0xFF) * myFormat.redMax + 127) / 255             \
     << myFormat.redShift |                                              \
@@ -38,25 +35,24 @@ static const char *ID = "$Id: cursor.c,v 1.5 2004/09/09 00:22:33 grmcdorman Exp
     << myFormat.blueShift)
 
 
-static Bool prevSoftCursorSet = False;
-/*static Pixmap rcSavedArea;*/
-static char *rcSavedArea;
-static CARD8 *rcSource, *rcMask;
+/*
+ * The cursor is never drawn into the frame buffer. Its shape, already in
+ * the frame buffer's pixel format, and its position are kept here, and
+ * DrawCursor() blends it into each image as it is saved.
+ */
+static Bool rcShapeSet = False, rcPositionSet = False;
+static char *rcPixels;
+static CARD8 *rcMask;
 static int rcHotX, rcHotY, rcWidth, rcHeight;
 static int rcCursorX = 0, rcCursorY = 0;
-static int rcLockX, rcLockY, rcLockWidth, rcLockHeight;
-static Bool rcCursorHidden, rcLockSet;
 
-static Bool SoftCursorInLockedArea(void);
-static void SoftCursorCopyArea(int oper);
-static void SoftCursorDraw(void);
 static void FreeSoftCursor(void);
 
 
 /*********************************************************************
  * HandleCursorShape(). Support for XCursor and RichCursor shape
- * updates. We emulate cursor operating on the frame buffer (that is
- * why we call it "software cursor").
+ * updates. The shape is kept in the frame buffer's pixel format, to be
+ * drawn over each saved image by DrawCursor().
  ********************************************************************/
 
 Bool HandleCursorShape(int xhot, int yhot, int width, int height, CARD32 enc)
@@ -67,7 +63,7 @@ Bool HandleCursorShape(int xhot, int yhot, int width, int height, CARD32 enc)
   rfbXCursorColors rgb;
   CARD32 colors[2];
   char *buf;
-  CARD8 *ptr;
+  CARD8 *rcSource, *ptr;
   int x, y, b;
 
   bytesPerPixel = myFormat.bitsPerPixel / 8;
@@ -182,22 +178,25 @@ Bool HandleCursorShape(int xhot, int yhot, int width, int height, CARD32 enc)
 
   free(buf);
 
+  /* Convert the pixels to the form the frame buffer stores them in. */
+
+  rcPixels = malloc(width * height * BufferComponents());
+  if (rcPixels == NULL) {
+    free(rcSource);
+    free(rcMask);
+    return False;
+  }
+  ConvertToBufferPixels((char *)rcSource, width * height, rcPixels);
+  free(rcSource);
+
   /* Set remaining data associated with cursor. */
 
-/*  dr = DefaultRootWindow(dpy);
-  rcSavedArea = XCreatePixmap(dpy, dr, width, height, visdepth);*/
   rcHotX = xhot;
   rcHotY = yhot;
   rcWidth = width;
   rcHeight = height;
-  /* Do not draw. Only draw when we have the position. */
-  SoftCursorCopyArea(OPER_SAVE);
-  /*SoftCursorDraw();*/
 
-  rcCursorHidden = False;
-  rcLockSet = False;
-
-  prevSoftCursorSet = True;
+  rcShapeSet = True;
   return True;
 }
 
@@ -215,186 +214,212 @@ Bool HandleCursorPos(int x, int y)
   if (y >= si.framebufferHeight)
     y = si.framebufferHeight - 1;
 
-  SoftCursorMove(x, y);
+  rcCursorX = x;
+  rcCursorY = y;
+  rcPositionSet = True;
   return True;
 }
 
 /*********************************************************************
- * SoftCursorLockArea(). This function should be used to prevent
- * collisions between simultaneous framebuffer update operations and
- * cursor drawing operations caused by movements of pointing device.
- * The parameters denote a rectangle where mouse cursor should not be
- * drawn. Every next call to this function expands locked area so
- * previous locks remain active.
+ * CursorRect(). Finds the screen rectangle covered by the cursor, if
+ * it is to be drawn at all: only with -cursor, and once both its shape
+ * and its position are known.
  ********************************************************************/
 
-void SoftCursorLockArea(int x, int y, int w, int h)
+Bool CursorRect(int *x, int *y, int *w, int *h)
 {
-  int newX, newY;
-
-  if (!BufferWritten()) {
-      return;    /* no cursor to hide */
-  }
-
-  if (!prevSoftCursorSet)
-    return;
-
-  if (!rcLockSet) {
-    rcLockX = x;
-    rcLockY = y;
-    rcLockWidth = w;
-    rcLockHeight = h;
-    rcLockSet = True;
-  } else {
-    newX = (x < rcLockX) ? x : rcLockX;
-    newY = (y < rcLockY) ? y : rcLockY;
-    rcLockWidth = (x + w > rcLockX + rcLockWidth) ?
-      (x + w - newX) : (rcLockX + rcLockWidth - newX);
-    rcLockHeight = (y + h > rcLockY + rcLockHeight) ?
-      (y + h - newY) : (rcLockY + rcLockHeight - newY);
-    rcLockX = newX;
-    rcLockY = newY;
-  }
+  if (!rcShapeSet || !rcPositionSet || appData.useRemoteCursor != 1)
+    return False;
 
-  if (!rcCursorHidden && SoftCursorInLockedArea()) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    rcCursorHidden = True;
-  }
+  *x = rcCursorX - rcHotX;
+  *y = rcCursorY - rcHotY;
+  *w = rcWidth;
+  *h = rcHeight;
+  return True;
 }
 
 /*********************************************************************
- * SoftCursorUnlockScreen(). This function discards all locks
- * performed since previous SoftCursorUnlockScreen() call.
+ * DrawCursor(). Draws the cursor over rows of stored pixels stride
+ * bytes apart at pixels, nx by ny of them starting at stored pixel
+ * (fx, fy). With -scale only the cursor pixels falling on a stored
+ * pixel are drawn, as for any other rectangle.
  ********************************************************************/
 
-void SoftCursorUnlockScreen(void)
+void DrawCursor(char *pixels, int stride, int fx, int fy, int nx, int ny)
 {
-  if (!prevSoftCursorSet)
+  int x, y, x0, y0, cx, cy, cw, ch;
+  int components = BufferComponents();
+  int round = appData.scale - 1;
+
+  if (!CursorRect(&cx, &cy, &cw, &ch))
     return;
 
-  if (rcCursorHidden) {
-    SoftCursorCopyArea(OPER_SAVE);
-    if (appData.useRemoteCursor == 1) {
-    SoftCursorDraw();
+  for (y = 0; y < ch; y++) {
+    y0 = cy + y;
+    if (y0 < 0 || y0 >= si.framebufferHeight || (y0 & round) != 0 ||
+	y0 / appData.scale < fy || y0 / appData.scale >= fy + ny)
+      continue;
+    for (x = 0; x < cw; x++) {
+      x0 = cx + x;
+      if (x0 < 0 || x0 >= si.framebufferWidth || (x0 & round) != 0 ||
+	  x0 / appData.scale < fx || x0 / appData.scale >= fx + nx ||
+	  !rcMask[y * cw + x])
+	continue;
+      memcpy(pixels + (y0 / appData.scale - fy) * stride +
+	     (x0 / appData.scale - fx) * components,
+	     rcPixels + (y * cw + x) * components, components);
     }
-    rcCursorHidden = False;
   }
-  rcLockSet = False;
 }
 
 /*********************************************************************
- * SoftCursorMove(). Moves soft cursor into a particular location. 
- * This function respects locking of screen areas so when the cursor
- * is moved into the locked area, it becomes invisible until
- * SoftCursorUnlock() functions is called.
+ * CursorShape(), CursorPosition() and SetCursorShape(). The cursor
+ * as it stands, for recording keyframes, each returning False while it
+ * is not known; and a recorded shape put back, for replaying from one.
+ * The shape's pixels are in the frame buffer's stored form, and its
+ * mask has a byte for each.
  ********************************************************************/
 
-void SoftCursorMove(int x, int y)
+Bool CursorShape(int *hotX, int *hotY, int *width, int *height,
+		 const char **pixels, const CARD8 **mask)
 {
-  if (prevSoftCursorSet && !rcCursorHidden) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    rcCursorHidden = True;
-  }
+  if (!rcShapeSet)
+    return False;
+  *hotX = rcHotX;
+  *hotY = rcHotY;
+  *width = rcWidth;
+  *height = rcHeight;
+  *pixels = rcPixels;
+  *mask = rcMask;
+  return True;
+}
 
-  rcCursorX = x;
-  rcCursorY = y;
+Bool CursorPosition(int *x, int *y)
+{
+  if (!rcPositionSet)
+    return False;
+  *x = rcCursorX;
+  *y = rcCursorY;
+  return True;
+}
+
+Bool SetCursorShape(int hotX, int hotY, int width, int height,
+		    const char *pixels, const CARD8 *mask)
+{
+  size_t n = (size_t)width * height;
 
-  if (prevSoftCursorSet && !(rcLockSet && SoftCursorInLockedArea())) {
-    SoftCursorCopyArea(OPER_SAVE);
-   if (appData.useRemoteCursor == 1) {
-    SoftCursorDraw();
-   }
-    rcCursorHidden = False;
+  FreeSoftCursor();
+  if (n == 0)
+    return True;
+  rcPixels = malloc(n * BufferComponents());
+  rcMask = malloc(n);
+  if (rcPixels == NULL || rcMask == NULL) {
+    free(rcPixels);
+    free(rcMask);
+    rcPixels = NULL;
+    rcMask = NULL;
+    return False;
   }
+  memcpy(rcPixels, pixels, n * BufferComponents());
+  memcpy(rcMask, mask, n);
+  rcHotX = hotX;
+  rcHotY = hotY;
+  rcWidth = width;
+  rcHeight = height;
+  rcShapeSet = True;
+  return True;
 }
 
-
 /*********************************************************************
- * Internal (static) low-level functions.
+ * SaveCursorState(), RestoreCursorState() and FreeCursorState(). A
+ * copy of the cursor's shape and position, for replay checkpoints.
  ********************************************************************/
 
-static Bool SoftCursorInLockedArea(void)
+typedef struct {
+  Bool shapeSet, positionSet;
+  char *pixels;
+  CARD8 *mask;
+  int hotX, hotY, width, height;
+  int cursorX, cursorY;
+} CursorState;
+
+void *SaveCursorState(void)
 {
-  return (rcLockX < rcCursorX - rcHotX + rcWidth &&
-	  rcLockY < rcCursorY - rcHotY + rcHeight &&
-	  rcLockX + rcLockWidth > rcCursorX - rcHotX &&
-	  rcLockY + rcLockHeight > rcCursorY - rcHotY);
+  CursorState *state = malloc(sizeof(CursorState));
+  size_t n = (size_t)rcWidth * rcHeight;
+
+  if (state == NULL)
+    return NULL;
+  state->shapeSet = rcShapeSet;
+  state->positionSet = rcPositionSet;
+  state->pixels = NULL;
+  state->mask = NULL;
+  if (rcShapeSet) {
+    state->pixels = malloc(n * BufferComponents());
+    state->mask = malloc(n);
+    if (state->pixels == NULL || state->mask == NULL) {
+      FreeCursorState(state);
+      return NULL;
+    }
+    memcpy(state->pixels, rcPixels, n * BufferComponents());
+    memcpy(state->mask, rcMask, n);
+  }
+  state->hotX = rcHotX;
+  state->hotY = rcHotY;
+  state->width = rcWidth;
+  state->height = rcHeight;
+  state->cursorX = rcCursorX;
+  state->cursorY = rcCursorY;
+  return state;
 }
 
-static void SoftCursorCopyArea(int oper)
+Bool RestoreCursorState(void *saved)
 {
-  int x, y, w, h;
-
-  x = rcCursorX - rcHotX;
-  y = rcCursorY - rcHotY;
-  if (x >= si.framebufferWidth || y >= si.framebufferHeight)
-    return;
-
-  w = rcWidth;
-  h = rcHeight;
-  if (x < 0) {
-    w += x;
-    x = 0;
-  } else if (x + w > si.framebufferWidth) {
-    w = si.framebufferWidth - x;
-  }
-  if (y < 0) {
-    h += y;
-    y = 0;
-  } else if (y + h > si.framebufferHeight) {
-    h = si.framebufferHeight - y;
-  }
+  CursorState *state = saved;
+  size_t n = (size_t)state->width * state->height;
 
-  if (oper == OPER_SAVE) {
-    /* Save screen area in memory. */
-    if (rcSavedArea != NULL) {
-        free(rcSavedArea);
-        rcSavedArea = NULL;
+  FreeSoftCursor();
+  if (state->shapeSet) {
+    rcPixels = malloc(n * BufferComponents());
+    rcMask = malloc(n);
+    if (rcPixels == NULL || rcMask == NULL) {
+      free(rcPixels);
+      free(rcMask);
+      return False;
     }
-    rcSavedArea = CopyScreenToData(x, y, w, h);
-  } else {
-    /* Restore screen area. */
-    CopyDataToScreen(rcSavedArea, x, y, w, h);
+    memcpy(rcPixels, state->pixels, n * BufferComponents());
+    memcpy(rcMask, state->mask, n);
+    rcShapeSet = True;
   }
+  rcHotX = state->hotX;
+  rcHotY = state->hotY;
+  rcWidth = state->width;
+  rcHeight = state->height;
+  rcCursorX = state->cursorX;
+  rcCursorY = state->cursorY;
+  rcPositionSet = state->positionSet;
+  return True;
 }
 
-static void SoftCursorDraw(void)
+void FreeCursorState(void *saved)
 {
-  int x, y, x0, y0;
-  int offset, bytesPerPixel;
-  char *pos;
-
-  bytesPerPixel = myFormat.bitsPerPixel / 8;
+  CursorState *state = saved;
 
-  /* FIXME: Speed optimization is possible. */
-  for (y = 0; y < rcHeight; y++) {
-    y0 = rcCursorY - rcHotY + y;
-    if (y0 >= 0 && y0 < si.framebufferHeight) {
-      for (x = 0; x < rcWidth; x++) {
-	x0 = rcCursorX - rcHotX + x;
-	if (x0 >= 0 && x0 < si.framebufferWidth) {
-	  offset = y * rcWidth + x;
-	  if (rcMask[offset]) {
-	    pos = (char *)&rcSource[offset * bytesPerPixel];
-	    CopyDataToScreen(pos, x0, y0, 1, 1);
-	  }
-	}
-      }
-    }
-  }
+  free(state->pixels);
+  free(state->mask);
+  free(state);
 }
 
+
+/*********************************************************************
+ * Internal (static) low-level functions.
+ ********************************************************************/
+
 static void FreeSoftCursor(void)
 {
-  if (prevSoftCursorSet) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    if (rcSavedArea != NULL) {
-        free(rcSavedArea);
-        rcSavedArea = NULL;
-    }
-    free(rcSource);
+  if (rcShapeSet) {
+    free(rcPixels);
     free(rcMask);
-    prevSoftCursorSet = False;
+    rcShapeSet = False;
   }
 }
-
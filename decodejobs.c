@@ -0,0 +1,261 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * decodejobs.c - run rectangle decoding on worker threads.
+ *
+ * A decoder hands a job to one of DECODE_QUEUES queues, each served by
+ * its own thread in order. Jobs on different queues run concurrently, so
+ * anything else that writes to the frame buffer must first wait for
+ * queued jobs whose rectangles it overlaps; WaitForDecodeRect() does
+ * that. Where threads are not available jobs simply run at once.
+ */
+static const char *ID = "$Id$";
+
+#include "vncsnapshot.h"
+
+#if !defined(WIN32) && !defined(NO_THREADS)
+#define DECODE_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef DECODE_THREADS
+
+#define DECODE_QUEUE_LENGTH 16
+
+typedef struct {
+  int x, y, w, h;
+  DecodeJobProc proc;
+  void *arg;
+} DecodeJob;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+  Bool started;
+  Bool failed;
+  /* jobs[done..queued) are waiting or running, indices modulo length */
+  unsigned int queued, done;
+  DecodeJob jobs[DECODE_QUEUE_LENGTH];
+} DecodeQueue;
+
+static DecodeQueue queues[DECODE_QUEUES];
+static Bool queuesInitialised = False;
+
+static void *
+DecodeThread(void *arg)
+{
+  DecodeQueue *q = (DecodeQueue *)arg;
+  DecodeJob job;
+  Bool ok;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->done == q->queued)
+      pthread_cond_wait(&q->changed, &q->lock);
+    job = q->jobs[q->done % DECODE_QUEUE_LENGTH];
+    pthread_mutex_unlock(&q->lock);
+
+    ok = job.proc(job.arg);
+
+    pthread_mutex_lock(&q->lock);
+    if (!ok)
+      q->failed = True;
+    q->done++;
+    pthread_cond_broadcast(&q->changed);
+  }
+  return NULL;
+}
+
+static Bool
+Overlaps(DecodeJob *job, int x, int y, int w, int h)
+{
+  return (job->x < x + w && x < job->x + job->w &&
+	  job->y < y + h && y < job->y + job->h);
+}
+
+/*
+ * Wait until no job on queue q overlaps the given rectangle. Returns False
+ * (once) if a job on the queue has failed.
+ */
+static Bool
+WaitForQueueRect(DecodeQueue *q, int x, int y, int w, int h, Bool all)
+{
+  unsigned int i, last = 0;
+  Bool found = False;
+  Bool ok;
+
+  if (!q->started)
+    return True;
+
+  pthread_mutex_lock(&q->lock);
+  for (i = q->done; i != q->queued; i++) {
+    if (all || Overlaps(&q->jobs[i % DECODE_QUEUE_LENGTH], x, y, w, h)) {
+      last = i;
+      found = True;
+    }
+  }
+  if (found) {
+    while ((int)(q->done - last) <= 0)
+      pthread_cond_wait(&q->changed, &q->lock);
+  }
+  ok = !q->failed;
+  q->failed = False;
+  pthread_mutex_unlock(&q->lock);
+
+  return ok;
+}
+
+Bool
+QueueDecodeJob(int queue, int x, int y, int w, int h,
+	       DecodeJobProc proc, void *arg)
+{
+  DecodeQueue *q;
+  Bool ok = True;
+  int i;
+
+  if (!queuesInitialised) {
+    for (i = 0; i < DECODE_QUEUES; i++) {
+      pthread_mutex_init(&queues[i].lock, NULL);
+      pthread_cond_init(&queues[i].changed, NULL);
+    }
+    queuesInitialised = True;
+  }
+
+  /* Jobs on other queues may not overtake writes they overlap. */
+  for (i = 0; i < DECODE_QUEUES; i++) {
+    if (i != queue && !WaitForQueueRect(&queues[i], x, y, w, h, False))
+      ok = False;
+  }
+
+  q = &queues[queue];
+  if (!q->started) {
+    if (pthread_create(&q->thread, NULL, DecodeThread, q) != 0) {
+      /* Fall back to decoding on this thread. */
+      return proc(arg) && ok;
+    }
+    pthread_detach(q->thread);
+    q->started = True;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (q->queued - q->done == DECODE_QUEUE_LENGTH)
+    pthread_cond_wait(&q->changed, &q->lock);
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].x = x;
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].y = y;
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].w = w;
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].h = h;
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].proc = proc;
+  q->jobs[q->queued % DECODE_QUEUE_LENGTH].arg = arg;
+  q->queued++;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+
+  return ok;
+}
+
+/*
+ * Handing rectangles to the threads only pays off when they can run on
+ * other processors: with one, the decoders' hand-offs and copies are pure
+ * cost, so they decode in place instead.
+ */
+Bool
+DecodeThreadsAvailable(void)
+{
+  static long processors = 0;
+
+  if (processors == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (processors < 1)
+      processors = 2;	/* not known; assume there are others */
+  }
+  return processors > 1;
+}
+
+Bool
+WaitForDecodeRect(int x, int y, int w, int h)
+{
+  Bool ok = True;
+  int i;
+
+  if (queuesInitialised) {
+    for (i = 0; i < DECODE_QUEUES; i++) {
+      if (!WaitForQueueRect(&queues[i], x, y, w, h, False))
+	ok = False;
+    }
+  }
+  return ok;
+}
+
+Bool
+WaitForDecodeQueue(int queue)
+{
+  if (!queuesInitialised)
+    return True;
+  return WaitForQueueRect(&queues[queue], 0, 0, 0, 0, True);
+}
+
+Bool
+WaitForDecodeJobs(void)
+{
+  Bool ok = True;
+  int i;
+
+  for (i = 0; i < DECODE_QUEUES; i++) {
+    if (!WaitForDecodeQueue(i))
+      ok = False;
+  }
+  return ok;
+}
+
+#else /* !DECODE_THREADS */
+
+Bool
+QueueDecodeJob(int queue, int x, int y, int w, int h,
+	       DecodeJobProc proc, void *arg)
+{
+  return proc(arg);
+}
+
+Bool
+DecodeThreadsAvailable(void)
+{
+  return False;
+}
+
+Bool
+WaitForDecodeRect(int x, int y, int w, int h)
+{
+  return True;
+}
+
+Bool
+WaitForDecodeQueue(int queue)
+{
+  return True;
+}
+
+Bool
+WaitForDecodeJobs(void)
+{
+  return True;
+}
+
+#endif /* DECODE_THREADS */
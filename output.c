@@ -0,0 +1,503 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * output.c - save one snapshot at several sizes.
+ *
+ * With -sizes each snapshot is written once per item of the list, all
+ * from the same frame buffer contents. The reduced images are made by
+ * halving the captured rectangle as often as the largest remaining size
+ * allows, then averaging the nearest halved level down to the exact size,
+ * so every halved level serves all the smaller sizes after it. Each image
+ * is compressed on a decode thread as soon as it is ready.
+ */
+static const char *ID = "$Id$";
+
+#include <ctype.h>
+
+#include "vncsnapshot.h"
+
+typedef struct {
+  char token[16];	/* "full", "640w", ...; inserted into file names */
+  char side;		/* 'w' or 'h', 0 for full size */
+  int size;
+  int quality;
+} OutputSize;
+
+static OutputSize *outputs = NULL;
+static int numOutputs = 0;
+
+/* An image in memory: the captured rectangle or a reduced copy of it. */
+typedef struct {
+  char *pixels;
+  int stride;
+  int width, height;
+  Bool allocated;
+} Image;
+
+typedef struct {
+  char *filename;
+  int quality;
+  int components;
+  Image image;
+} EncodeJob;
+
+static Bool ParseOutputSize(char *item, OutputSize *out);
+static Bool AllocateImage(Image *image, int width, int height, int components);
+static void HalveImage(const Image *src, Image *dst, int components);
+static Bool ResampleImage(const Image *src, Image *dst, int components);
+static Bool EncodeImage(void *arg);
+
+
+/*
+ * SetOutputSizes() parses the -sizes list: items separated by commas or
+ * spaces, each "full", "<N>w" or "<N>h" with an optional "@q<QUALITY>".
+ * The first full-size item is written to the file named on the command
+ * line; every other item to that name with "-<item>" before the
+ * extension, e.g. "shot-640w.jpg".
+ */
+Bool
+SetOutputSizes(char *list, char *filename)
+{
+  char *copy, *item;
+  int i, n;
+  Bool haveFull = False;
+
+  if (list == NULL)
+    return True;
+
+  copy = (char *) malloc(strlen(list) + 1);
+  outputs = (OutputSize *) malloc((strlen(list) / 2 + 1) * sizeof(OutputSize));
+  if (copy == NULL || outputs == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  strcpy(copy, list);
+
+  n = 0;
+  for (item = strtok(copy, ", "); item != NULL; item = strtok(NULL, ", ")) {
+    if (!ParseOutputSize(item, &outputs[n])) {
+      fprintf(stderr, "%s: invalid -sizes item %s, expected full, <N>w or <N>h,\n"
+	      "   optionally followed by @q<QUALITY>\n", programName, item);
+      free(copy);
+      return False;
+    }
+    for (i = 0; i < n; i++) {
+      if (strcmp(outputs[i].token, outputs[n].token) == 0) {
+	fprintf(stderr, "%s: -sizes lists %s twice\n", programName,
+		outputs[n].token);
+	free(copy);
+	return False;
+      }
+    }
+    /* The first full-size item keeps the plain file name. */
+    if (outputs[n].side == 0 && !haveFull) {
+      OutputSize first = outputs[n];
+      for (i = n; i > 0; i--)
+	outputs[i] = outputs[i - 1];
+      outputs[0] = first;
+      haveFull = True;
+    }
+    n++;
+  }
+  free(copy);
+
+  if (n == 0) {
+    fprintf(stderr, "%s: -sizes needs at least one size\n", programName);
+    return False;
+  }
+  if (n > 1 && filename != NULL && strcmp(filename, "-") == 0) {
+    fprintf(stderr, "%s: only one size can be written to standard output\n",
+	    programName);
+    return False;
+  }
+
+  numOutputs = n;
+  return True;
+}
+
+static Bool
+ParseOutputSize(char *item, OutputSize *out)
+{
+  char *at, *end;
+  long n;
+
+  out->quality = appData.saveQuality;
+  at = strchr(item, '@');
+  if (at != NULL) {
+    *at++ = '\0';
+    if (*at == 'q' || *at == 'Q')
+      at++;
+    n = strtol(at, &end, 10);
+    if (end == at || *end != '\0' || n < 0 || n > 100)
+      return False;
+    out->quality = n;
+  }
+
+  if (strlen(item) >= sizeof(out->token))
+    return False;
+  strcpy(out->token, item);
+
+  if (strcmp(item, "full") == 0) {
+    out->side = 0;
+    out->size = 0;
+    return True;
+  }
+  n = strtol(item, &end, 10);
+  if (end == item || n <= 0 || n > 65535 ||
+      (tolower(*end) != 'w' && tolower(*end) != 'h') || end[1] != '\0')
+    return False;
+  out->side = tolower(*end);
+  out->size = n;
+  return True;
+}
+
+/*
+ * WriteSnapshot() saves the screen rectangle to filename, and with -sizes
+ * to one file per listed size.
+ */
+Bool
+WriteSnapshot(char *filename, int x, int y, int w, int h)
+{
+  EncodeJob *jobs;
+  Image *levels;
+  int *order;
+  int components = BufferComponents();
+  int numLevels = 1, maxLevels;
+  int i, j, k;
+  Bool ok = True;
+
+  if (numOutputs == 0) {
+    write_JPEG_file(filename, appData.saveQuality, x, y, w, h);
+    return True;
+  }
+
+  jobs = (EncodeJob *) calloc(numOutputs, sizeof(EncodeJob));
+  order = (int *) malloc(numOutputs * sizeof(int));
+  maxLevels = 32;	/* the source and one level per bit of its size */
+  levels = (Image *) calloc(maxLevels, sizeof(Image));
+  if (jobs == NULL || order == NULL || levels == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    exit(1);
+  }
+
+  levels[0].pixels = BufferRectPixels(x, y, w, h, &levels[0].stride,
+				      &levels[0].width, &levels[0].height);
+  if (levels[0].pixels == NULL) {
+    /* A tiled frame buffer is put in rows first. */
+    if (!AllocateImage(&levels[0], levels[0].width, levels[0].height,
+		       components))
+      exit(1);
+    GetBufferRows(x, y, w, h, levels[0].pixels, levels[0].stride);
+  }
+  w = levels[0].width;
+  h = levels[0].height;
+
+  /* Work out each size, keeping the aspect ratio and never enlarging. */
+  for (i = 0; i < numOutputs; i++) {
+    EncodeJob *job = &jobs[i];
+    OutputSize *out = &outputs[i];
+
+    job->quality = out->quality;
+    job->components = components;
+    job->image.width = w;
+    job->image.height = h;
+    if (out->side == 'w' && out->size < w) {
+      job->image.width = out->size;
+      job->image.height = (int)(((long)h * out->size + w / 2) / w);
+    } else if (out->side == 'h' && out->size < h) {
+      job->image.height = out->size;
+      job->image.width = (int)(((long)w * out->size + h / 2) / h);
+    }
+    if (job->image.width < 1)
+      job->image.width = 1;
+    if (job->image.height < 1)
+      job->image.height = 1;
+
+    /* Standard output takes the only size, whatever it is. */
+    job->filename =
+      i == 0 && (out->side == 0 || strcmp(filename, "-") == 0) ?
+      filename : OutputFileName(filename, out->token);
+    if (job->filename == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      exit(1);
+    }
+
+    /* Largest first, so that halved levels are made in sequence. */
+    for (j = i; j > 0 &&
+	   jobs[order[j - 1]].image.width < job->image.width; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  for (i = 0; i < numOutputs && ok; i++) {
+    EncodeJob *job = &jobs[order[i]];
+    Image *level;
+    int tw = job->image.width, th = job->image.height;
+
+    /* Halve for as long as the result still covers this size. Only
+     * even sizes are halved, so that every level is an exact average. */
+    for (;;) {
+      Image *last = &levels[numLevels - 1];
+
+      if (numLevels == maxLevels || (last->width & 1) || (last->height & 1) ||
+	  last->width / 2 < tw || last->height / 2 < th)
+	break;
+      if (!AllocateImage(&levels[numLevels], last->width / 2,
+			 last->height / 2, components)) {
+	ok = False;
+	break;
+      }
+      HalveImage(last, &levels[numLevels], components);
+      numLevels++;
+    }
+    if (!ok)
+      break;
+
+    /* The smallest level still covering this size in both directions. */
+    for (k = numLevels - 1; k > 0; k--) {
+      if (levels[k].width >= tw && levels[k].height >= th)
+	break;
+    }
+    level = &levels[k];
+
+    if (level->width == tw && level->height == th) {
+      job->image = *level;
+      job->image.allocated = False;
+    } else if (!ResampleImage(level, &job->image, components)) {
+      ok = False;
+      break;
+    }
+
+    if (!QueueDecodeJob(i % DECODE_QUEUES, 0, 0, 0, 0, EncodeImage, job))
+      ok = False;
+  }
+
+  if (!WaitForDecodeJobs())
+    ok = False;
+
+  for (i = 0; i < numOutputs; i++) {
+    if (jobs[i].image.allocated)
+      free(jobs[i].image.pixels);
+    if (jobs[i].filename != filename)
+      free(jobs[i].filename);
+  }
+  for (k = 0; k < numLevels; k++) {
+    if (levels[k].allocated)
+      free(levels[k].pixels);
+  }
+  free(levels);
+  free(order);
+  free(jobs);
+
+  if (!ok)
+    fprintf(stderr, "%s: failed to write %s\n", programName, filename);
+  return ok;
+}
+
+/*
+ * Insert "-<token>" before the extension of filename, if it has one. The
+ * result is allocated with malloc().
+ */
+char *
+OutputFileName(const char *filename, const char *token)
+{
+  const char *dot = strrchr(filename, '.');
+  const char *slash = strrchr(filename, '/');
+  char *name;
+  size_t len;
+
+#ifdef WIN32
+  if (strrchr(filename, '\\') > slash)
+    slash = strrchr(filename, '\\');
+#endif
+  if (dot == NULL || (slash != NULL && dot < slash) || dot == filename ||
+      dot == slash + 1)
+    dot = filename + strlen(filename);
+  len = dot - filename;
+
+  name = (char *) malloc(strlen(filename) + strlen(token) + 2);
+  if (name == NULL)
+    return NULL;
+  memcpy(name, filename, len);
+  sprintf(name + len, "-%s%s", token, dot);
+  return name;
+}
+
+static Bool
+AllocateImage(Image *image, int width, int height, int components)
+{
+  image->width = width;
+  image->height = height;
+  image->stride = width * components;
+  image->pixels = (char *) malloc((size_t)image->stride * height);
+  image->allocated = image->pixels != NULL;
+  if (image->pixels == NULL) {
+    fprintf(stderr, "%s: out of memory for %dx%d image\n", programName,
+	    width, height);
+    return False;
+  }
+  return True;
+}
+
+/*
+ * Average each 2x2 block of src, which has an even width and height, into
+ * one pixel of dst. The loops are kept simple enough for the compiler to
+ * vectorise.
+ */
+static void
+HalveImage(const Image *src, Image *dst, int components)
+{
+  int x, y, c;
+
+  for (y = 0; y < dst->height; y++) {
+    const CARD8 *r0 = (const CARD8 *) src->pixels + 2 * y * src->stride;
+    const CARD8 *r1 = r0 + src->stride;
+    CARD8 *d = (CARD8 *) dst->pixels + y * dst->stride;
+
+    if (components == 1) {
+      for (x = 0; x < dst->width; x++)
+	d[x] = (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2;
+    } else {
+      for (x = 0; x < dst->width; x++) {
+	for (c = 0; c < components; c++) {
+	  int i = 2 * x * components + c;
+	  d[x * components + c] =
+	    (r0[i] + r0[i + components] + r1[i] + r1[i + components] + 2) >> 2;
+	}
+      }
+    }
+  }
+}
+
+/*
+ * For each destination pixel along one axis, the source pixels it covers
+ * and how much of it each covers, in 1/256ths summing to exactly 256.
+ */
+typedef struct {
+  int first, count;
+  int *weights;
+} Span;
+
+static Span *
+AreaSpans(int from, int to, int **weights)
+{
+  Span *spans = (Span *) malloc(to * sizeof(Span));
+  int i, j, n = 0;
+
+  /* Neighbouring spans share at most one source pixel. */
+  *weights = (int *) malloc(((size_t)from + 2 * to) * sizeof(int));
+  if (spans == NULL || *weights == NULL) {
+    free(spans);
+    free(*weights);
+    return NULL;
+  }
+
+  /* Destination pixel i is [i * from, (i + 1) * from) in units of 1/to
+   * source pixel; source pixel j is [j * to, (j + 1) * to). */
+  for (i = 0; i < to; i++) {
+    double start = (double)i * from, end = start + from;
+    int prev = 0;
+
+    spans[i].first = (int)(start / to);
+    spans[i].count = 0;
+    spans[i].weights = *weights + n;
+    for (j = spans[i].first; j < from && (double)j * to < end; j++) {
+      double cover = (double)(j + 1) * to;
+      int cum;
+
+      if (cover > end)
+	cover = end;
+      cum = (int)((cover - start) * 256 / from + 0.5);
+      spans[i].weights[spans[i].count++] = cum - prev;
+      prev = cum;
+    }
+    n += spans[i].count;
+  }
+  return spans;
+}
+
+/*
+ * Reduce src to the size already set in dst by averaging the area of src
+ * under each dst pixel. Sums stay in 32 bits: at most 255 * 256 across a
+ * row, then at most 256 times that down a column.
+ */
+static Bool
+ResampleImage(const Image *src, Image *dst, int components)
+{
+  Span *xs, *ys;
+  int *xw, *yw;
+  unsigned int *rowSum, *acc;
+  int n = dst->width * components;
+  int x, y, j, k, c;
+
+  if (!AllocateImage(dst, dst->width, dst->height, components))
+    return False;
+
+  xs = AreaSpans(src->width, dst->width, &xw);
+  ys = AreaSpans(src->height, dst->height, &yw);
+  rowSum = (unsigned int *) malloc(n * sizeof(unsigned int));
+  acc = (unsigned int *) malloc(n * sizeof(unsigned int));
+  if (xs == NULL || ys == NULL || rowSum == NULL || acc == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    exit(1);
+  }
+
+  for (y = 0; y < dst->height; y++) {
+    CARD8 *d = (CARD8 *) dst->pixels + y * dst->stride;
+
+    memset(acc, 0, n * sizeof(unsigned int));
+    for (j = 0; j < ys[y].count; j++) {
+      const CARD8 *s = (const CARD8 *) src->pixels +
+	(ys[y].first + j) * src->stride;
+      unsigned int wy = ys[y].weights[j];
+
+      for (x = 0; x < dst->width; x++) {
+	const CARD8 *p = s + xs[x].first * components;
+	for (c = 0; c < components; c++) {
+	  unsigned int sum = 0;
+	  for (k = 0; k < xs[x].count; k++)
+	    sum += xs[x].weights[k] * p[k * components + c];
+	  rowSum[x * components + c] = sum;
+	}
+      }
+      for (x = 0; x < n; x++)
+	acc[x] += wy * rowSum[x];
+    }
+    for (x = 0; x < n; x++)
+      d[x] = (acc[x] + 32768) >> 16;
+  }
+
+  free(acc);
+  free(rowSum);
+  free(xs);
+  free(xw);
+  free(ys);
+  free(yw);
+  return True;
+}
+
+static Bool
+EncodeImage(void *arg)
+{
+  EncodeJob *job = (EncodeJob *) arg;
+
+  write_JPEG_image(job->filename, job->quality, job->image.pixels,
+		   job->image.stride, job->components,
+		   job->image.width, job->image.height);
+  return True;
+}
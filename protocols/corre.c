@@ -34,10 +34,10 @@ static Bool
 HandleCoRREBPP (int rx, int ry, int rw, int rh)
 {
     rfbRREHeader hdr;
-    unsigned int i;
+    unsigned int remaining, n, i;
     CARDBPP pix;
     CARD8 *ptr;
-    int x, y, w, h;
+    char *data;
 
     if (!ReadFromRFBServer((char *)&hdr, sz_rfbRREHeader))
 	return False;
@@ -49,20 +49,28 @@ HandleCoRREBPP (int rx, int ry, int rw, int rh)
 
     FillBufferRectangle(rx, ry, rw, rh, pix);
 
-    if (!ReadFromRFBServer(buffer, hdr.nSubrects * (4 + (BPP / 8))))
-	return False;
-
-    ptr = (CARD8 *)buffer;
+    /* Decode the subrectangles from the input buffer a batch at a time. */
+    for (remaining = hdr.nSubrects; remaining > 0; remaining -= n) {
+	n = PeekFromRFBServer(&data, 4 + (BPP / 8),
+			      remaining < SUBRECT_BATCH ? remaining : SUBRECT_BATCH);
+	if (n == 0)
+	    return False;
 
-    for (i = 0; i < hdr.nSubrects; i++) {
-	pix = *(CARDBPP *)ptr;
-	ptr += BPP/8;
-	x = *ptr++;
-	y = *ptr++;
-	w = *ptr++;
-	h = *ptr++;
+	ptr = (CARD8 *)data;
+	for (i = 0; i < n; i++) {
+	    pix = 0;
+	    memcpy(&pix, ptr, BPP / 8);
+	    ptr += BPP / 8;
+	    subrects[i].pixel = pix;
+	    subrects[i].x = ptr[0];
+	    subrects[i].y = ptr[1];
+	    subrects[i].w = ptr[2];
+	    subrects[i].h = ptr[3];
+	    ptr += 4;
+	}
+	SkipFromRFBServer(n * (4 + (BPP / 8)));
 
-        FillBufferRectangle(rx + x, ry + y, w, h, pix);
+	FillBufferSubrects(rx, ry, rw, rh, subrects, n);
     }
 
     return True;
@@ -28,19 +28,176 @@
  */
 
 #define HandleHextileBPP CONCAT2E(HandleHextile,BPP)
+#define SkipHextileBPP CONCAT2E(SkipHextile,BPP)
+#define HextileTileBytesBPP CONCAT2E(HextileTileBytes,BPP)
 #define CARDBPP CONCAT2E(CARD,BPP)
 #define GET_PIXEL CONCAT2E(GET_PIXEL,BPP)
 
+/*
+ * Each tile is decoded straight out of the input buffer once all of it has
+ * arrived. HextileTileBytes() works out how many bytes that is from the
+ * first avail bytes of the tile, asking for more of them where necessary.
+ */
+
+static unsigned int
+HextileTileBytesBPP (const CARD8 *p, unsigned int avail, int w, int h)
+{
+  CARD8 subencoding;
+  unsigned int len;
+
+  if (avail < 1)
+    return 1;
+  subencoding = p[0];
+
+  if (subencoding & rfbHextileRaw)
+    return 1 + w * h * (BPP / 8);
+
+  len = 1;
+  if (subencoding & rfbHextileBackgroundSpecified)
+    len += BPP / 8;
+  if (subencoding & rfbHextileForegroundSpecified)
+    len += BPP / 8;
+  if (!(subencoding & rfbHextileAnySubrects))
+    return len;
+
+  if (avail < len + 1)
+    return len + 1;
+  if (subencoding & rfbHextileSubrectsColoured)
+    return len + 1 + p[len] * (2 + BPP / 8);
+  return len + 1 + p[len] * 2;
+}
+
+#if BPP == 32 && !defined(HEXTILE_RGB24_KERNELS)
+#define HEXTILE_RGB24_KERNELS
+
+/*
+ * Kernels for 24-bit pixels, writing straight into the packed frame buffer
+ * at dst. HextileTileRGB24() is inlined into one function for whole 16x16
+ * tiles and another for the tiles along the right and bottom edges, so that
+ * the common case is compiled for a fixed tile size. bg and fg are the
+ * colours carried over from the previous tile. Returns the end of the
+ * tile's data.
+ */
+
+static INLINE void
+HextileFillRGB24 (char *dst, int stride, int w, int h, const CARD8 *pix)
+{
+  char *row = dst;
+  int i;
+
+  for (i = 0; i < w; i++) {
+    row[i * 3] = pix[0];
+    row[i * 3 + 1] = pix[1];
+    row[i * 3 + 2] = pix[2];
+  }
+  for (i = 1; i < h; i++) {
+    row += stride;
+    memcpy(row, dst, w * 3);
+  }
+}
+
+static INLINE const CARD8 *
+HextileTileRGB24 (char *dst, int stride, const CARD8 *p, int w, int h,
+		  CARD8 *bg, CARD8 *fg)
+{
+  CARD8 subencoding = *p++;
+  const CARD8 *pix;
+  int nSubrects, i, sx, sy, sw, sh;
+  char *row;
+
+  if (subencoding & rfbHextileRaw) {
+    for (sy = 0; sy < h; sy++) {
+      row = dst + sy * stride;
+      for (sx = 0; sx < w; sx++) {
+	row[0] = p[0];
+	row[1] = p[1];
+	row[2] = p[2];
+	row += 3;
+	p += 4;
+      }
+    }
+    return p;
+  }
+
+  if (subencoding & rfbHextileBackgroundSpecified) {
+    memcpy(bg, p, 3);
+    p += 4;
+  }
+
+  HextileFillRGB24(dst, stride, w, h, bg);
+
+  if (subencoding & rfbHextileForegroundSpecified) {
+    memcpy(fg, p, 3);
+    p += 4;
+  }
+
+  if (!(subencoding & rfbHextileAnySubrects))
+    return p;
+
+  nSubrects = *p++;
+  pix = fg;
+  for (i = 0; i < nSubrects; i++) {
+    if (subencoding & rfbHextileSubrectsColoured) {
+      pix = p;
+      p += 4;
+    }
+    sx = rfbHextileExtractX(p[0]);
+    sy = rfbHextileExtractY(p[0]);
+    sw = rfbHextileExtractW(p[1]);
+    sh = rfbHextileExtractH(p[1]);
+    p += 2;
+
+    /* Subrectangles may not stray outside their tile. */
+    if (sx + sw > w)
+      sw = w - sx;
+    if (sy + sh > h)
+      sh = h - sy;
+    if (sw > 0 && sh > 0)
+      HextileFillRGB24(dst + sy * stride + sx * 3, stride, sw, sh, pix);
+  }
+
+  /* The last subrectangle's colour is the next tile's foreground. */
+  if (pix != fg)
+    memcpy(fg, pix, 3);
+
+  return p;
+}
+
+static const CARD8 *
+HextileFullTileRGB24 (char *dst, int stride, const CARD8 *p,
+		      CARD8 *bg, CARD8 *fg)
+{
+  return HextileTileRGB24(dst, stride, p, 16, 16, bg, fg);
+}
+
+static const CARD8 *
+HextileEdgeTileRGB24 (char *dst, int stride, const CARD8 *p, int w, int h,
+		      CARD8 *bg, CARD8 *fg)
+{
+  return HextileTileRGB24(dst, stride, p, w, h, bg, fg);
+}
+
+#endif
+
 static Bool
 HandleHextileBPP (int rx, int ry, int rw, int rh)
 {
-  CARDBPP bg, fg;
+  CARDBPP bg = 0, fg = 0;
   int i;
   CARD8 *ptr;
+  char *data;
+  unsigned int avail, len;
   int x, y, w, h;
   int sx, sy, sw, sh;
   CARD8 subencoding;
   CARD8 nSubrects;
+#if BPP == 32
+  char *dst = NULL, *tile;
+  int stride;
+  CARD8 bg24[3] = { 0, 0, 0 }, fg24[3] = { 0, 0, 0 };
+
+  dst = DirectBufferRect(rx, ry, rw, rh, &stride);
+#endif
 
   for (y = ry; y < ry+rh; y += 16) {
     for (x = rx; x < rx+rw; x += 16) {
@@ -50,68 +207,116 @@ HandleHextileBPP (int rx, int ry, int rw, int rh)
       if (ry+rh - y < 16)
 	h = ry+rh - y;
 
-      if (!ReadFromRFBServer((char *)&subencoding, 1))
-	return False;
-
-      if (subencoding & rfbHextileRaw) {
-	if (!ReadFromRFBServer(buffer, w * h * (BPP / 8)))
+      /* Wait for the whole tile. */
+      for (;;) {
+	avail = rfbIn.end - rfbIn.ptr;
+	len = HextileTileBytesBPP(rfbIn.ptr, avail, w, h);
+	if (len <= avail)
+	  break;
+	if (PeekFromRFBServer(&data, len, 1) == 0)
 	  return False;
+      }
+      ptr = (CARD8 *)rfbIn.ptr;
 
-	CopyDataToScreen(buffer, x, y, w, h);
+#if BPP == 32
+      if (dst != NULL) {
+	tile = dst + (y - ry) * stride + (x - rx) * 3;
+
+	if (w == 16 && h == 16)
+	  HextileFullTileRGB24(tile, stride, ptr, bg24, fg24);
+	else
+	  HextileEdgeTileRGB24(tile, stride, ptr, w, h, bg24, fg24);
+	SkipFromRFBServer(len);
 	continue;
       }
 
-      if (subencoding & rfbHextileBackgroundSpecified)
-	if (!ReadFromRFBServer((char *)&bg, sizeof(bg)))
-	  return False;
-
-      FillBufferRectangle(x, y, w, h, bg);
+      /* A tiled or partly captured frame buffer may still take this tile
+	 directly. The colours carried over are kept in both forms, as the
+	 next tile may not. */
+      if ((tile = DirectBufferRect(x, y, w, h, &stride)) != NULL) {
+	memcpy(bg24, &bg, 3);
+	memcpy(fg24, &fg, 3);
+	HextileEdgeTileRGB24(tile, stride, ptr, w, h, bg24, fg24);
+	memcpy(&bg, bg24, 3);
+	memcpy(&fg, fg24, 3);
+	DirectBufferWritten(x, y, w, h);
+	SkipFromRFBServer(len);
+	continue;
+      }
+#endif
 
-      if (subencoding & rfbHextileForegroundSpecified)
-	if (!ReadFromRFBServer((char *)&fg, sizeof(fg)))
-	  return False;
+      subencoding = *ptr++;
 
-      if (!(subencoding & rfbHextileAnySubrects)) {
+      if (subencoding & rfbHextileRaw) {
+	CopyDataToScreen((char *)ptr, x, y, w, h);
+	SkipFromRFBServer(len);
 	continue;
       }
 
-      if (!ReadFromRFBServer((char *)&nSubrects, 1))
-	return False;
+      if (subencoding & rfbHextileBackgroundSpecified)
+	GET_PIXEL(bg, ptr);
 
-      ptr = (CARD8 *)buffer;
+      FillBufferRectangle(x, y, w, h, bg);
 
-      if (subencoding & rfbHextileSubrectsColoured) {
-	if (!ReadFromRFBServer(buffer, nSubrects * (2 + (BPP / 8))))
-	  return False;
+      if (subencoding & rfbHextileForegroundSpecified)
+	GET_PIXEL(fg, ptr);
+
+      if (subencoding & rfbHextileAnySubrects) {
+	nSubrects = *ptr++;
 
 	for (i = 0; i < nSubrects; i++) {
-	  GET_PIXEL(fg, ptr);
+	  if (subencoding & rfbHextileSubrectsColoured)
+	    GET_PIXEL(fg, ptr);
 	  sx = rfbHextileExtractX(*ptr);
 	  sy = rfbHextileExtractY(*ptr);
 	  ptr++;
 	  sw = rfbHextileExtractW(*ptr);
 	  sh = rfbHextileExtractH(*ptr);
 	  ptr++;
-          FillBufferRectangle(x+sx, y+sy, sw, sh, fg);
+	  FillBufferRectangle(x+sx, y+sy, sw, sh, fg);
 	}
+      }
 
-      } else {
-	if (!ReadFromRFBServer(buffer, nSubrects * 2))
-	  return False;
+      SkipFromRFBServer(len);
+    }
+  }
 
+#if BPP == 32
+  if (dst != NULL)
+    DirectBufferWritten(rx, ry, rw, rh);
+#endif
 
-	for (i = 0; i < nSubrects; i++) {
-	  sx = rfbHextileExtractX(*ptr);
-	  sy = rfbHextileExtractY(*ptr);
-	  ptr++;
-	  sw = rfbHextileExtractW(*ptr);
-	  sh = rfbHextileExtractH(*ptr);
-	  ptr++;
-          FillBufferRectangle(x+sx, y+sy, sw, sh, fg);
-	}
+  return True;
+}
+
+/*
+ * SkipHextile() reads past a rectangle outside the captured regions. The
+ * tiles' colours only carry over within a rectangle, so nothing needs to
+ * be decoded; only each tile's length is worked out.
+ */
+
+static Bool
+SkipHextileBPP (int rw, int rh)
+{
+  char *data;
+  unsigned int avail, len;
+  int x, y, w, h;
+
+  for (y = 0; y < rh; y += 16) {
+    for (x = 0; x < rw; x += 16) {
+      w = (rw - x < 16) ? rw - x : 16;
+      h = (rh - y < 16) ? rh - y : 16;
+
+      for (;;) {
+	avail = rfbIn.end - rfbIn.ptr;
+	len = HextileTileBytesBPP(rfbIn.ptr, avail, w, h);
+	if (len <= avail)
+	  break;
+	if (PeekFromRFBServer(&data, len, 1) == 0)
+	  return False;
       }
+      SkipFromRFBServer(len);
     }
   }
-
   return True;
 }
@@ -34,9 +34,10 @@ static Bool
 HandleRREBPP (int rx, int ry, int rw, int rh)
 {
   rfbRREHeader hdr;
-  unsigned int i;
+  unsigned int remaining, n, i;
   CARDBPP pix;
-  rfbRectangle subrect;
+  CARD8 *ptr;
+  char *data;
 
   if (!ReadFromRFBServer((char *)&hdr, sz_rfbRREHeader))
     return False;
@@ -48,20 +49,28 @@ HandleRREBPP (int rx, int ry, int rw, int rh)
 
   FillBufferRectangle(rx, ry, rw, rh, pix);
 
-  for (i = 0; i < hdr.nSubrects; i++) {
-    if (!ReadFromRFBServer((char *)&pix, sizeof(pix)))
+  /* Decode the subrectangles from the input buffer a batch at a time. */
+  for (remaining = hdr.nSubrects; remaining > 0; remaining -= n) {
+    n = PeekFromRFBServer(&data, (BPP / 8) + sz_rfbRectangle,
+			  remaining < SUBRECT_BATCH ? remaining : SUBRECT_BATCH);
+    if (n == 0)
       return False;
 
-    if (!ReadFromRFBServer((char *)&subrect, sz_rfbRectangle))
-      return False;
-
-    subrect.x = Swap16IfLE(subrect.x);
-    subrect.y = Swap16IfLE(subrect.y);
-    subrect.w = Swap16IfLE(subrect.w);
-    subrect.h = Swap16IfLE(subrect.h);
+    ptr = (CARD8 *)data;
+    for (i = 0; i < n; i++) {
+      pix = 0;
+      memcpy(&pix, ptr, BPP / 8);
+      ptr += BPP / 8;
+      subrects[i].pixel = pix;
+      subrects[i].x = ptr[0] << 8 | ptr[1];
+      subrects[i].y = ptr[2] << 8 | ptr[3];
+      subrects[i].w = ptr[4] << 8 | ptr[5];
+      subrects[i].h = ptr[6] << 8 | ptr[7];
+      ptr += sz_rfbRectangle;
+    }
+    SkipFromRFBServer(n * ((BPP / 8) + sz_rfbRectangle));
 
-    FillBufferRectangle(rx + subrect.x, ry + subrect.y,
-		   subrect.w, subrect.h, pix);
+    FillBufferSubrects(rx, ry, rw, rh, subrects, n);
   }
 
   return True;
@@ -30,12 +30,15 @@
 #define TIGHT_MIN_TO_COMPRESS 12
 
 #define CARDBPP CONCAT2E(CARD,BPP)
-#define filterPtrBPP CONCAT2E(filterPtr,BPP)
 
 #define HandleTightBPP CONCAT2E(HandleTight,BPP)
+#define DecodeTightJobBPP CONCAT2E(DecodeTightJob,BPP)
+#define StartTightRectBPP CONCAT2E(StartTightRect,BPP)
+#define InflateTightBPP CONCAT2E(InflateTight,BPP)
+#define FinishTightRectBPP CONCAT2E(FinishTightRect,BPP)
 #define InitFilterCopyBPP CONCAT2E(InitFilterCopy,BPP)
 #define InitFilterPaletteBPP CONCAT2E(InitFilterPalette,BPP)
-#define InitFilterGradientBPP CONCAT2E(InitFilterGradient,BPP)
+#define FilterRowsBPP CONCAT2E(FilterRows,BPP)
 #define FilterCopyBPP CONCAT2E(FilterCopy,BPP)
 #define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
 #define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
@@ -46,40 +49,57 @@
 
 #ifndef RGB_TO_PIXEL
 
+/* myFormat is fixed for each pixel size; see MY_RED_SHIFT_8 and so on. */
+#define MY_FORMAT(name,bpp) CONCAT2E(name,bpp)
+
 #define RGB_TO_PIXEL(bpp,r,g,b)						\
-  (((CARD##bpp)(r) & myFormat.redMax) << myFormat.redShift |		\
-   ((CARD##bpp)(g) & myFormat.greenMax) << myFormat.greenShift |	\
-   ((CARD##bpp)(b) & myFormat.blueMax) << myFormat.blueShift)
+  (((CARD##bpp)(r) & MY_FORMAT(MY_RED_MAX_,bpp))			\
+   << MY_FORMAT(MY_RED_SHIFT_,bpp) |					\
+   ((CARD##bpp)(g) & MY_FORMAT(MY_GREEN_MAX_,bpp))			\
+   << MY_FORMAT(MY_GREEN_SHIFT_,bpp) |					\
+   ((CARD##bpp)(b) & MY_FORMAT(MY_BLUE_MAX_,bpp))			\
+   << MY_FORMAT(MY_BLUE_SHIFT_,bpp))
 
 #define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
-   ((((CARD##bpp)(r) & 0xFF) * myFormat.redMax + 127) / 255             \
-    << myFormat.redShift |                                              \
-    (((CARD##bpp)(g) & 0xFF) * myFormat.greenMax + 127) / 255           \
-    << myFormat.greenShift |                                            \
-    (((CARD##bpp)(b) & 0xFF) * myFormat.blueMax + 127) / 255            \
-    << myFormat.blueShift)
+   ((((CARD##bpp)(r) & 0xFF) * MY_FORMAT(MY_RED_MAX_,bpp) + 127) / 255 \
+    << MY_FORMAT(MY_RED_SHIFT_,bpp) |                                   \
+    (((CARD##bpp)(g) & 0xFF) * MY_FORMAT(MY_GREEN_MAX_,bpp) + 127) / 255 \
+    << MY_FORMAT(MY_GREEN_SHIFT_,bpp) |                                 \
+    (((CARD##bpp)(b) & 0xFF) * MY_FORMAT(MY_BLUE_MAX_,bpp) + 127) / 255 \
+    << MY_FORMAT(MY_BLUE_SHIFT_,bpp))
 
 #define RGB24_TO_PIXEL32(r,g,b)						\
-  (((CARD32)(r) & 0xFF) << myFormat.redShift |				\
-   ((CARD32)(g) & 0xFF) << myFormat.greenShift |			\
-   ((CARD32)(b) & 0xFF) << myFormat.blueShift)
+  (((CARD32)(r) & 0xFF) << MY_RED_SHIFT_32 |				\
+   ((CARD32)(g) & 0xFF) << MY_GREEN_SHIFT_32 |				\
+   ((CARD32)(b) & 0xFF) << MY_BLUE_SHIFT_32)
 
 #endif
 
-/* Type declarations */
-
-typedef void (*filterPtrBPP)(int, CARDBPP *);
-
 /* Prototypes */
 
-static int InitFilterCopyBPP (int rw, int rh);
-static int InitFilterPaletteBPP (int rw, int rh);
-static int InitFilterGradientBPP (int rw, int rh);
-static void FilterCopyBPP (int numRows, CARDBPP *destBuffer);
-static void FilterPaletteBPP (int numRows, CARDBPP *destBuffer);
-static void FilterGradientBPP (int numRows, CARDBPP *destBuffer);
+static Bool DecodeTightJobBPP (void *arg);
+static Bool StartTightRectBPP (TightRect *tr, TightContext *ctx);
+static Bool InflateTightBPP (TightRect *tr, TightContext *ctx,
+			     char *data, int len);
+static Bool FinishTightRectBPP (TightRect *tr);
+static int InitFilterCopyBPP (TightFilter *tf, int rw, int rh);
+static int InitFilterPaletteBPP (TightFilter *tf, int rw, int rh);
+static void FilterRowsBPP (TightRect *tr, TightContext *ctx, int numRows,
+			   CARDBPP *destBuffer);
+static void FilterCopyBPP (TightFilter *tf, TightContext *ctx, int numRows,
+			   CARDBPP *destBuffer);
+static void FilterPaletteBPP (TightFilter *tf, TightContext *ctx,
+			      int numRows, CARDBPP *destBuffer);
+static void FilterGradientBPP (TightFilter *tf, TightContext *ctx,
+			       int numRows, CARDBPP *destBuffer);
 
+#if BPP != 8
 static Bool DecompressJpegRectBPP(int x, int y, int w, int h);
+#endif
+
+#if BPP == 32
+static Bool InflateCopy24 (TightRect *tr, TightContext *ctx, z_streamp zs);
+#endif
 
 /* Definitions */
 
@@ -88,12 +108,10 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
 {
   CARDBPP fill_colour;
   CARD8 comp_ctl;
-  CARD8 filter_id;
-  filterPtrBPP filterFn;
+  TightRect tr, *job;
   z_streamp zs;
-  char *buffer2;
-  int err, stream_id, compressedLen, bitsPixel;
-  int bufferSize, rowSize, numRows, portionLen, rowsProcessed, extraBytes;
+  char *buffer2, *compressedData;
+  int err, stream_id, compressedLen, rowSize, portionLen;
 
   if (!ReadFromRFBServer((char *)&comp_ctl, 1))
     return False;
@@ -101,6 +119,9 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
   /* Flush zlib streams if we are told by the server to do so. */
   for (stream_id = 0; stream_id < 4; stream_id++) {
     if ((comp_ctl & 1) && zlibStreamActive[stream_id]) {
+      /* Rectangles queued on the stream still need its old state. */
+      if (!WaitForDecodeQueue(stream_id))
+	return False;
       if (inflateEnd (&zlibStream[stream_id]) != Z_OK &&
 	  zlibStream[stream_id].msg != NULL)
 	fprintf(stderr, "inflateEnd: %s\n", zlibStream[stream_id].msg);
@@ -126,6 +147,8 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
 	return False;
 #endif
 
+    if (!WaitForDecodeRect(rx, ry, rw, rh))
+      return False;
     FillBufferRectangle(rx, ry, rw, rh, fill_colour);
     return True;
   }
@@ -137,6 +160,8 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
   }
 #else
   if (comp_ctl == rfbTightJpeg) {
+    if (!WaitForDecodeRect(rx, ry, rw, rh))
+      return False;
     return DecompressJpegRectBPP(rx, ry, rw, rh);
   }
 #endif
@@ -152,45 +177,51 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
    * Data was processed with optional filter + zlib compression.
    */
 
+  tr.rx = rx;
+  tr.ry = ry;
+  tr.rw = rw;
+  tr.rh = rh;
+  tr.streamId = comp_ctl & 0x03;
+  tr.rowsDone = 0;
+  tr.extraBytes = 0;
+  tr.dataLen = 0;
+
   /* First, we should identify a filter to use. */
+  tr.filterId = rfbTightFilterCopy;
   if ((comp_ctl & rfbTightExplicitFilter) != 0) {
-    if (!ReadFromRFBServer((char*)&filter_id, 1))
+    if (!ReadFromRFBServer((char*)&tr.filterId, 1))
       return False;
+  }
 
-    switch (filter_id) {
-    case rfbTightFilterCopy:
-      filterFn = FilterCopyBPP;
-      bitsPixel = InitFilterCopyBPP(rw, rh);
-      break;
-    case rfbTightFilterPalette:
-      filterFn = FilterPaletteBPP;
-      bitsPixel = InitFilterPaletteBPP(rw, rh);
-      break;
-    case rfbTightFilterGradient:
-      filterFn = FilterGradientBPP;
-      bitsPixel = InitFilterGradientBPP(rw, rh);
-      break;
-    default:
-      fprintf(stderr, "Tight encoding: unknown filter code received.\n");
-      return False;
-    }
-  } else {
-    filterFn = FilterCopyBPP;
-    bitsPixel = InitFilterCopyBPP(rw, rh);
+  switch (tr.filterId) {
+  case rfbTightFilterCopy:
+  case rfbTightFilterGradient:
+    tr.bitsPixel = InitFilterCopyBPP(&tr.filter, rw, rh);
+    break;
+  case rfbTightFilterPalette:
+    tr.bitsPixel = InitFilterPaletteBPP(&tr.filter, rw, rh);
+    break;
+  default:
+    fprintf(stderr, "Tight encoding: unknown filter code received.\n");
+    return False;
   }
-  if (bitsPixel == 0) {
+  if (tr.bitsPixel == 0) {
     fprintf(stderr, "Tight encoding: error receiving palette.\n");
     return False;
   }
 
   /* Determine if the data should be decompressed or just copied. */
-  rowSize = (rw * bitsPixel + 7) / 8;
+  rowSize = (rw * tr.bitsPixel + 7) / 8;
   if (rh * rowSize < TIGHT_MIN_TO_COMPRESS) {
     if (!ReadFromRFBServer((char*)buffer, rh * rowSize))
       return False;
 
+    if (!StartTightRectBPP(&tr, &tightContext) ||
+	!WaitForDecodeRect(rx, ry, rw, rh))
+      return False;
+
     buffer2 = &buffer[TIGHT_MIN_TO_COMPRESS * 4];
-    filterFn(rh, (CARDBPP *)buffer2);
+    FilterRowsBPP(&tr, &tightContext, rh, (CARDBPP *)buffer2);
     CopyDataToScreen(buffer2, rx, ry, rw, rh);
 
     return True;
@@ -204,7 +235,7 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
   }
 
   /* Now let's initialize compression stream if needed. */
-  stream_id = comp_ctl & 0x03;
+  stream_id = tr.streamId;
   zs = &zlibStream[stream_id];
   if (!zlibStreamActive[stream_id]) {
     zs->zalloc = Z_NULL;
@@ -219,64 +250,168 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
     zlibStreamActive[stream_id] = True;
   }
 
-  /* Read, decode and draw actual pixel data in a loop. */
-
-  bufferSize = BUFFER_SIZE * bitsPixel / (bitsPixel + BPP) & 0xFFFFFFFC;
-  buffer2 = &buffer[bufferSize];
-  if (rowSize > bufferSize) {
-    /* Should be impossible when BUFFER_SIZE >= 16384 */
-    fprintf(stderr, "Internal error: incorrect buffer size.\n");
-    return False;
+  /*
+   * Where there are decoding threads, hand the rectangle to the one for
+   * its zlib stream, so that the streams are inflated concurrently.
+   */
+  if (DecodeThreadsAvailable()) {
+    job = malloc(sizeof(TightRect) + compressedLen);
+    if (job == NULL) {
+      fprintf(stderr, "Memory allocation error.\n");
+      return False;
+    }
+    *job = tr;
+    job->dataLen = compressedLen;
+    if (!ReadFromRFBServer((char *)(job + 1), compressedLen)) {
+      free(job);
+      return False;
+    }
+    return QueueDecodeJob(stream_id, rx, ry, rw, rh, DecodeTightJobBPP, job);
   }
 
-  rowsProcessed = 0;
-  extraBytes = 0;
+  /*
+   * Otherwise read, decode and draw actual pixel data in a loop. The
+   * compressed data is fed to inflate() straight from the socket input
+   * buffer, as much of it at a time as has been received.
+   */
+  if (!StartTightRectBPP(&tr, &tightContext))
+    return False;
 
   while (compressedLen > 0) {
-    if (compressedLen > ZLIB_BUFFER_SIZE)
-      portionLen = ZLIB_BUFFER_SIZE;
-    else
-      portionLen = compressedLen;
+    portionLen = PeekFromRFBServer(&compressedData, 1, compressedLen);
+    if (portionLen == 0)
+      return False;
 
-    if (!ReadFromRFBServer((char*)zlib_buffer, portionLen))
+    if (!InflateTightBPP(&tr, &tightContext, compressedData, portionLen))
       return False;
 
+    SkipFromRFBServer(portionLen);
     compressedLen -= portionLen;
+  }
 
-    zs->next_in = (Bytef *)zlib_buffer;
-    zs->avail_in = portionLen;
+  return FinishTightRectBPP(&tr);
+}
 
-    do {
-      zs->next_out = (Bytef *)&buffer[extraBytes];
-      zs->avail_out = bufferSize - extraBytes;
+/*
+ * Decode a rectangle queued by HandleTightBPP(), on its stream's thread.
+ */
 
-      err = inflate(zs, Z_SYNC_FLUSH);
-      if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
-	break;
-      if (err != Z_OK && err != Z_STREAM_END) {
-	if (zs->msg != NULL) {
-	  fprintf(stderr, "Inflate error: %s.\n", zs->msg);
-	} else {
-	  fprintf(stderr, "Inflate error: %d.\n", err);
-	}
-	return False;
-      }
+static Bool
+DecodeTightJobBPP (void *arg)
+{
+  TightRect *tr = (TightRect *)arg;
+  TightContext *ctx = &tightStreamContext[tr->streamId];
+  Bool ok;
+
+  if (ctx->buffer == NULL) {
+    ctx->buffer = malloc(BUFFER_SIZE);
+    if (ctx->buffer == NULL) {
+      fprintf(stderr, "Memory allocation error.\n");
+      free(tr);
+      return False;
+    }
+  }
+
+  ok = (StartTightRectBPP(tr, ctx) &&
+	InflateTightBPP(tr, ctx, (char *)(tr + 1), tr->dataLen) &&
+	FinishTightRectBPP(tr));
+
+  free(tr);
+  return ok;
+}
+
+static Bool
+StartTightRectBPP (TightRect *tr, TightContext *ctx)
+{
+  tr->dst = NULL;
+
+#if BPP == 32
+  /* Unfiltered 24-bit data needs no conversion at all. */
+  if (tr->filterId == rfbTightFilterCopy && tr->filter.cutZeros)
+    tr->dst = DirectBufferRect(tr->rx, tr->ry, tr->rw, tr->rh, &tr->stride);
+#endif
+
+  if (tr->filterId == rfbTightFilterGradient) {
+    if (!AllocateTightRows(ctx, tr->rw))
+      return False;
+    if (tr->filter.cutZeros)
+      memset(ctx->prevRow, 0, tr->rw * 3);
+    else
+      memset(ctx->prevRow, 0, tr->rw * 3 * sizeof(CARD16));
+  }
+
+  return True;
+}
+
+/*
+ * Inflate the next len bytes of compressed data for a rectangle, and draw
+ * the complete rows they produce. A row may be split between calls.
+ */
 
-      numRows = (bufferSize - zs->avail_out) / rowSize;
+static Bool
+InflateTightBPP (TightRect *tr, TightContext *ctx, char *data, int len)
+{
+  z_streamp zs = &zlibStream[tr->streamId];
+  char *buffer2;
+  int err, bufferSize, rowSize, numRows;
+
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = len;
+
+#if BPP == 32
+  if (tr->dst != NULL)
+    return InflateCopy24(tr, ctx, zs);
+#endif
 
-      filterFn(numRows, (CARDBPP *)buffer2);
+  rowSize = (tr->rw * tr->bitsPixel + 7) / 8;
+  bufferSize = BUFFER_SIZE * tr->bitsPixel / (tr->bitsPixel + BPP) & 0xFFFFFFFC;
+  buffer2 = &ctx->buffer[bufferSize];
+  if (rowSize > bufferSize) {
+    /* Should be impossible when BUFFER_SIZE >= 16384 */
+    fprintf(stderr, "Internal error: incorrect buffer size.\n");
+    return False;
+  }
 
-      extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
-      if (extraBytes > 0)
-	memcpy(buffer, &buffer[numRows * rowSize], extraBytes);
+  do {
+    zs->next_out = (Bytef *)&ctx->buffer[tr->extraBytes];
+    zs->avail_out = bufferSize - tr->extraBytes;
 
-      CopyDataToScreen(buffer2, rx, ry + rowsProcessed, rw, numRows);
-      rowsProcessed += numRows;
+    err = inflate(zs, Z_SYNC_FLUSH);
+    if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
+      break;
+    if (err != Z_OK && err != Z_STREAM_END) {
+      if (zs->msg != NULL) {
+	fprintf(stderr, "Inflate error: %s.\n", zs->msg);
+      } else {
+	fprintf(stderr, "Inflate error: %d.\n", err);
+      }
+      return False;
     }
-    while (zs->avail_out == 0);
+
+    numRows = (bufferSize - zs->avail_out) / rowSize;
+
+    FilterRowsBPP(tr, ctx, numRows, (CARDBPP *)buffer2);
+
+    tr->extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
+    if (tr->extraBytes > 0)
+      memcpy(ctx->buffer, &ctx->buffer[numRows * rowSize], tr->extraBytes);
+
+    CopyDataToScreen(buffer2, tr->rx, tr->ry + tr->rowsDone, tr->rw, numRows);
+    tr->rowsDone += numRows;
   }
+  while (zs->avail_out == 0);
+
+  return True;
+}
 
-  if (rowsProcessed != rh) {
+static Bool
+FinishTightRectBPP (TightRect *tr)
+{
+  if (tr->dst != NULL)
+    DirectBufferWritten(tr->rx, tr->ry, tr->rw,
+			(tr->rowsDone < tr->rh) ? tr->rowsDone : tr->rh);
+
+  if (tr->rowsDone != tr->rh) {
     fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
     return False;
   }
@@ -284,6 +419,63 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
   return True;
 }
 
+#if BPP == 32
+
+/*
+ * With the copy filter and cutZeros the inflated data is packed RGB, the
+ * same layout as the frame buffer, so it is inflated straight into the
+ * destination rows. A row may be completed over several inflate() calls.
+ * Once all rows are filled the rest of the input (the sync flush marker)
+ * is inflated into the context's buffer, where any output is an error.
+ */
+
+static Bool
+InflateCopy24 (TightRect *tr, TightContext *ctx, z_streamp zs)
+{
+  int rowSize, err;
+
+  rowSize = tr->rw * 3;
+
+  for (;;) {
+    if (tr->rowsDone < tr->rh) {
+      zs->next_out = (Bytef *)&tr->dst[tr->rowsDone * tr->stride +
+				       tr->extraBytes];
+      zs->avail_out = rowSize - tr->extraBytes;
+    } else {
+      zs->next_out = (Bytef *)ctx->buffer;
+      zs->avail_out = BUFFER_SIZE;
+    }
+
+    err = inflate(zs, Z_SYNC_FLUSH);
+    if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
+      break;
+    if (err != Z_OK && err != Z_STREAM_END) {
+      if (zs->msg != NULL) {
+	fprintf(stderr, "Inflate error: %s.\n", zs->msg);
+      } else {
+	fprintf(stderr, "Inflate error: %d.\n", err);
+      }
+      return False;
+    }
+
+    if (tr->rowsDone >= tr->rh) {
+      if (zs->avail_out != BUFFER_SIZE)
+	tr->rowsDone++;       /* more data than the rectangle holds */
+      break;
+    }
+
+    tr->extraBytes = rowSize - zs->avail_out;
+    if (tr->extraBytes < rowSize)
+      break;
+    tr->rowsDone++;
+    tr->extraBytes = 0;
+  }
+
+  return True;
+}
+
+#endif
+
 /*----------------------------------------------------------------------------
  *
  * Filter stuff.
@@ -291,25 +483,24 @@ HandleTightBPP (int rx, int ry, int rw, int rh)
  */
 
 /*
-   The following variables are defined in rfbproto.c:
-     static Bool cutZeros;
-     static int rectWidth, rectColors;
-     static CARD8 tightPalette[256*4];
-     static CARD8 tightPrevRow[2048*3*sizeof(CARD16)];
+   The following types are defined in rfbproto.c:
+     TightFilter - filter parameters of a rectangle (cutZeros, rectWidth,
+		   rectColors, palette)
+     TightContext - buffer and gradient rows of the decoding thread
 */
 
 static int
-InitFilterCopyBPP (int rw, int rh)
+InitFilterCopyBPP (TightFilter *tf, int rw, int rh)
 {
-  rectWidth = rw;
+  tf->rectWidth = rw;
 
 #if BPP == 32
   if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
       myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
-    cutZeros = True;
+    tf->cutZeros = True;
     return 24;
   } else {
-    cutZeros = False;
+    tf->cutZeros = False;
   }
 #endif
 
@@ -317,13 +508,31 @@ InitFilterCopyBPP (int rw, int rh)
 }
 
 static void
-FilterCopyBPP (int numRows, CARDBPP *dst)
+FilterRowsBPP (TightRect *tr, TightContext *ctx, int numRows, CARDBPP *dst)
+{
+  switch (tr->filterId) {
+  case rfbTightFilterPalette:
+    FilterPaletteBPP(&tr->filter, ctx, numRows, dst);
+    break;
+  case rfbTightFilterGradient:
+    FilterGradientBPP(&tr->filter, ctx, numRows, dst);
+    break;
+  default:
+    FilterCopyBPP(&tr->filter, ctx, numRows, dst);
+    break;
+  }
+}
+
+static void
+FilterCopyBPP (TightFilter *tf, TightContext *ctx, int numRows, CARDBPP *dst)
 {
 
 #if BPP == 32
   int x, y;
+  int rectWidth = tf->rectWidth;
+  char *buffer = ctx->buffer;
 
-  if (cutZeros) {
+  if (tf->cutZeros) {
     for (y = 0; y < numRows; y++) {
       for (x = 0; x < rectWidth; x++) {
 	dst[y*rectWidth+x] =
@@ -336,79 +545,75 @@ FilterCopyBPP (int numRows, CARDBPP *dst)
   }
 #endif
 
-  memcpy (dst, buffer, numRows * rectWidth * (BPP / 8));
+  memcpy (dst, ctx->buffer, numRows * tf->rectWidth * (BPP / 8));
 }
 
-static int
-InitFilterGradientBPP (int rw, int rh)
-{
-  int bits;
-
-  bits = InitFilterCopyBPP(rw, rh);
-  if (cutZeros)
-    memset(tightPrevRow, 0, rw * 3);
-  else
-    memset(tightPrevRow, 0, rw * 3 * sizeof(CARD16));
+#if BPP == 32
 
-  return bits;
-}
+#ifndef GRADIENT_CLAMP
+#define GRADIENT_CLAMP(est, max) ((est) < 0 ? 0 : (est) > (max) ? (max) : (est))
+#endif
 
-#if BPP == 32
+/*
+ * Each pixel depends on the one to its left, so the work cannot be spread
+ * across pixels; instead the three components are handled side by side
+ * with a branch-free clamp, and the row buffers are swapped rather than
+ * copied.
+ */
 
 static void
-FilterGradient24 (int numRows, CARD32 *dst)
+FilterGradient24 (TightFilter *tf, TightContext *ctx, int numRows, CARD32 *dst)
 {
-  int x, y, c;
-  CARD8 thisRow[2048*3];
-  CARD8 pix[3];
-  int est[3];
+  int x, y;
+  CARD8 *src = (CARD8 *)ctx->buffer;
+  CARD8 *prevRow, *thisRow;
+  int r, g, b, estR, estG, estB;
 
   for (y = 0; y < numRows; y++) {
+    prevRow = ctx->prevRow;
+    thisRow = ctx->thisRow;
 
     /* First pixel in a row */
-    for (c = 0; c < 3; c++) {
-      pix[c] = tightPrevRow[c] + buffer[y*rectWidth*3+c];
-      thisRow[c] = pix[c];
-    }
-    dst[y*rectWidth] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    r = thisRow[0] = (CARD8)(prevRow[0] + src[0]);
+    g = thisRow[1] = (CARD8)(prevRow[1] + src[1]);
+    b = thisRow[2] = (CARD8)(prevRow[2] + src[2]);
+    *dst++ = RGB24_TO_PIXEL32(r, g, b);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < rectWidth; x++) {
-      for (c = 0; c < 3; c++) {
-	est[c] = (int)tightPrevRow[x*3+c] + (int)pix[c] -
-		 (int)tightPrevRow[(x-1)*3+c];
-	if (est[c] > 0xFF) {
-	  est[c] = 0xFF;
-	} else if (est[c] < 0x00) {
-	  est[c] = 0x00;
-	}
-	pix[c] = (CARD8)est[c] + buffer[(y*rectWidth+x)*3+c];
-	thisRow[x*3+c] = pix[c];
-      }
-      dst[y*rectWidth+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    for (x = 3; x < tf->rectWidth * 3; x += 3) {
+      estR = prevRow[x] + r - prevRow[x-3];
+      estG = prevRow[x+1] + g - prevRow[x-2];
+      estB = prevRow[x+2] + b - prevRow[x-1];
+      r = thisRow[x] = (CARD8)(GRADIENT_CLAMP(estR, 0xFF) + src[x]);
+      g = thisRow[x+1] = (CARD8)(GRADIENT_CLAMP(estG, 0xFF) + src[x+1]);
+      b = thisRow[x+2] = (CARD8)(GRADIENT_CLAMP(estB, 0xFF) + src[x+2]);
+      *dst++ = RGB24_TO_PIXEL32(r, g, b);
     }
 
-    memcpy(tightPrevRow, thisRow, rectWidth * 3);
+    src += tf->rectWidth * 3;
+    ctx->prevRow = thisRow;
+    ctx->thisRow = prevRow;
   }
 }
 
 #endif
 
 static void
-FilterGradientBPP (int numRows, CARDBPP *dst)
+FilterGradientBPP (TightFilter *tf, TightContext *ctx, int numRows,
+		   CARDBPP *dst)
 {
   int x, y, c;
-  CARDBPP *src = (CARDBPP *)buffer;
-  CARD16 *thatRow = (CARD16 *)tightPrevRow;
-  CARD16 thisRow[2048*3];
+  int rectWidth = tf->rectWidth;
+  CARDBPP *src = (CARDBPP *)ctx->buffer;
+  CARD16 *thatRow, *thisRow;
   CARD16 pix[3];
   CARD16 max[3];
   int shift[3];
   int est[3];
 
 #if BPP == 32
-  if (cutZeros) {
-    FilterGradient24(numRows, dst);
+  if (tf->cutZeros) {
+    FilterGradient24(tf, ctx, numRows, dst);
     return;
   }
 #endif
@@ -422,10 +627,12 @@ FilterGradientBPP (int numRows, CARDBPP *dst)
   shift[2] = myFormat.blueShift;
 
   for (y = 0; y < numRows; y++) {
+    thatRow = (CARD16 *)ctx->prevRow;
+    thisRow = (CARD16 *)ctx->thisRow;
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = (CARD16)((src[y*rectWidth] >> shift[c]) + thatRow[c] & max[c]);
+      pix[c] = (CARD16)(((src[y*rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
       thisRow[c] = pix[c];
     }
     dst[y*rectWidth] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
@@ -439,68 +646,87 @@ FilterGradientBPP (int numRows, CARDBPP *dst)
 	} else if (est[c] < 0) {
 	  est[c] = 0;
 	}
-	pix[c] = (CARD16)((src[y*rectWidth+x] >> shift[c]) + est[c] & max[c]);
+	pix[c] = (CARD16)(((src[y*rectWidth+x] >> shift[c]) + est[c]) & max[c]);
 	thisRow[x*3+c] = pix[c];
       }
       dst[y*rectWidth+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, rectWidth * 3 * sizeof(CARD16));
+    ctx->prevRow = (CARD8 *)thisRow;
+    ctx->thisRow = (CARD8 *)thatRow;
   }
 }
 
 static int
-InitFilterPaletteBPP (int rw, int rh)
+InitFilterPaletteBPP (TightFilter *tf, int rw, int rh)
 {
   int i;
   CARD8 numColors;
-  CARDBPP *palette = (CARDBPP *)tightPalette;
+  CARDBPP *palette = (CARDBPP *)tf->palette;
+  CARDBPP (*mono)[4] = (CARDBPP (*)[4])tf->monoPixels;
 
-  rectWidth = rw;
+  tf->rectWidth = rw;
 
   if (!ReadFromRFBServer((char*)&numColors, 1))
     return 0;
 
-  rectColors = (int)numColors;
-  if (++rectColors < 2)
+  tf->rectColors = (int)numColors;
+  if (++tf->rectColors < 2)
     return 0;
 
 #if BPP == 32
   if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
       myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
-    if (!ReadFromRFBServer((char*)&tightPalette, rectColors * 3))
+    if (!ReadFromRFBServer((char*)tf->palette, tf->rectColors * 3))
       return 0;
-    for (i = rectColors - 1; i >= 0; i--) {
-      palette[i] = RGB24_TO_PIXEL32(tightPalette[i*3],
-				    tightPalette[i*3+1],
-				    tightPalette[i*3+2]);
+    for (i = tf->rectColors - 1; i >= 0; i--) {
+      palette[i] = RGB24_TO_PIXEL32(tf->palette[i*3],
+				    tf->palette[i*3+1],
+				    tf->palette[i*3+2]);
     }
-    return (rectColors == 2) ? 1 : 8;
+  } else {
+    if (!ReadFromRFBServer((char*)tf->palette, tf->rectColors * 4))
+      return 0;
   }
+#else
+  if (!ReadFromRFBServer((char*)tf->palette, tf->rectColors * (BPP / 8)))
+    return 0;
 #endif
 
-  if (!ReadFromRFBServer((char*)&tightPalette, rectColors * (BPP / 8)))
-    return 0;
+  if (tf->rectColors > 2)
+    return 8;
 
-  return (rectColors == 2) ? 1 : 8;
+  /* Pixels for every group of four bits, to expand 1-bit data with. */
+  for (i = 0; i < 16; i++) {
+    mono[i][0] = palette[i >> 3 & 1];
+    mono[i][1] = palette[i >> 2 & 1];
+    mono[i][2] = palette[i >> 1 & 1];
+    mono[i][3] = palette[i & 1];
+  }
+  return 1;
 }
 
 static void
-FilterPaletteBPP (int numRows, CARDBPP *dst)
+FilterPaletteBPP (TightFilter *tf, TightContext *ctx, int numRows,
+		  CARDBPP *dst)
 {
   int x, y, b, w;
-  CARD8 *src = (CARD8 *)buffer;
-  CARDBPP *palette = (CARDBPP *)tightPalette;
+  int rectWidth = tf->rectWidth;
+  CARD8 *src = (CARD8 *)ctx->buffer;
+  CARDBPP *palette = (CARDBPP *)tf->palette;
+  CARDBPP (*mono)[4] = (CARDBPP (*)[4])tf->monoPixels;
 
-  if (rectColors == 2) {
+  if (tf->rectColors == 2) {
     w = (rectWidth + 7) / 8;
     for (y = 0; y < numRows; y++) {
       for (x = 0; x < rectWidth / 8; x++) {
-	for (b = 7; b >= 0; b--)
-	  dst[y*rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	memcpy(&dst[x*8], mono[src[x] >> 4], 4 * sizeof(CARDBPP));
+	memcpy(&dst[x*8+4], mono[src[x] & 0x0F], 4 * sizeof(CARDBPP));
       }
       for (b = 7; b >= 8 - rectWidth % 8; b--) {
-	dst[y*rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	dst[x*8+7-b] = palette[src[x] >> b & 1];
       }
+      src += w;
+      dst += rectWidth;
     }
   } else {
     for (y = 0; y < numRows; y++)
@@ -520,21 +746,24 @@ FilterPaletteBPP (int numRows, CARDBPP *dst)
 /*
    The following variables are defined in rfbproto.c:
      static Bool jpegError;
-     static struct jpeg_source_mgr jpegSrcManager;
-     static JOCTET *jpegBufferPtr;
-     static size_t *jpegBufferLen;
+     static struct jpeg_decompress_struct jpegInfo;
+     static struct jpeg_error_mgr jpegErrorMgr;
+     static Bool jpegInfoCreated;
 */
 
+#ifndef TIGHT_JPEG_ROWS
+#define TIGHT_JPEG_ROWS 16
+#endif
+
 static Bool
 DecompressJpegRectBPP(int x, int y, int w, int h)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
   int compressedLen;
-  CARD8 *compressedData;
   CARDBPP *pixelPtr;
-  JSAMPROW rowPointer[1];
-  int dx, dy;
+  JSAMPROW rowPointer[TIGHT_JPEG_ROWS];
+  char *dst = NULL;
+  int stride;
+  int dx, dy, n, rows;
 
   compressedLen = (int)ReadCompactLen();
   if (compressedLen <= 0) {
@@ -542,55 +771,74 @@ DecompressJpegRectBPP(int x, int y, int w, int h)
     return False;
   }
 
-  compressedData = malloc(compressedLen);
-  if (compressedData == NULL) {
-    fprintf(stderr, "Memory allocation error.\n");
-    return False;
+  if (!jpegInfoCreated) {
+    jpegInfo.err = jpeg_std_error(&jpegErrorMgr);
+    jpeg_create_decompress(&jpegInfo);
+    jpegInfoCreated = True;
   }
 
-  if (!ReadFromRFBServer((char*)compressedData, compressedLen)) {
-    free(compressedData);
-    return False;
-  }
-
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
+  /* The compressed data is read by libjpeg as it decodes. */
+  JpegSetSrcManager(&jpegInfo, compressedLen);
 
-  JpegSetSrcManager(&cinfo, compressedData, compressedLen);
+  jpeg_read_header(&jpegInfo, TRUE);
+  jpegInfo.out_color_space = JCS_RGB;
+  /* With -scale, libjpeg reduces the rectangle in the DCT instead. */
+  jpegInfo.scale_num = 1;
+  jpegInfo.scale_denom = appData.scale;
 
-  jpeg_read_header(&cinfo, TRUE);
-  cinfo.out_color_space = JCS_RGB;
-
-  jpeg_start_decompress(&cinfo);
-  if (cinfo.output_width != (unsigned int) w || cinfo.output_height != (unsigned int) h ||
-      cinfo.output_components != 3) {
+  jpeg_start_decompress(&jpegInfo);
+  if (jpegInfo.output_width != (unsigned int) (w + appData.scale - 1) / appData.scale ||
+      jpegInfo.output_height != (unsigned int) (h + appData.scale - 1) / appData.scale ||
+      jpegInfo.output_components != 3) {
     fprintf(stderr, "Tight Encoding: Wrong JPEG data received.\n");
-    jpeg_destroy_decompress(&cinfo);
-    free(compressedData);
+    jpeg_abort_decompress(&jpegInfo);
+    JpegDrainSource();
     return False;
   }
 
-  rowPointer[0] = (JSAMPROW)buffer;
+#if BPP == 32
+  /* 24-bit RGB scanlines are already in frame buffer format. */
+  dst = DirectBufferRect(x, y, w, h, &stride);
+#endif
+
   dy = 0;
-  while (cinfo.output_scanline < cinfo.output_height) {
-    jpeg_read_scanlines(&cinfo, rowPointer, 1);
-    if (jpegError) {
-      break;
+  if (dst != NULL) {
+    while (dy < h && !jpegError) {
+      n = (h - dy < TIGHT_JPEG_ROWS) ? h - dy : TIGHT_JPEG_ROWS;
+      for (rows = 0; rows < n; rows++)
+	rowPointer[rows] = (JSAMPROW)(dst + (dy + rows) * stride);
+      rows = jpeg_read_scanlines(&jpegInfo, rowPointer, n);
+      if (rows == 0)
+	break;
+      dy += rows;
     }
-    pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
-    for (dx = 0; dx < w; dx++) {
-      *pixelPtr++ =
-	RGB24_TO_PIXEL(BPP, buffer[dx*3], buffer[dx*3+1], buffer[dx*3+2]);
+    DirectBufferWritten(x, y, w, dy);
+  } else {
+    rowPointer[0] = (JSAMPROW)buffer;
+    while (jpegInfo.output_scanline < jpegInfo.output_height) {
+      jpeg_read_scanlines(&jpegInfo, rowPointer, 1);
+      if (jpegError) {
+	break;
+      }
+      pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
+      for (dx = 0; dx < (int)jpegInfo.output_width; dx++) {
+	*pixelPtr++ =
+	  RGB24_TO_PIXEL(BPP, buffer[dx*3], buffer[dx*3+1], buffer[dx*3+2]);
+      }
+      /* Each row stands for the next appData.scale rows of the rectangle. */
+      n = (h - dy < appData.scale) ? h - dy : appData.scale;
+      CopyScaledDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + dy, w, n);
+      dy += n;
     }
-    CopyDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + dy, w, 1);
-    dy++;
   }
 
   if (!jpegError)
-    jpeg_finish_decompress(&cinfo);
+    jpeg_finish_decompress(&jpegInfo);
+  else
+    jpeg_abort_decompress(&jpegInfo);
 
-  jpeg_destroy_decompress(&cinfo);
-  free(compressedData);
+  if (!JpegDrainSource())
+    return False;
 
   return !jpegError;
 }
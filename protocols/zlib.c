@@ -36,42 +36,35 @@ HandleZlibBPP (int rx, int ry, int rw, int rh)
   rfbZlibHeader hdr;
   int remaining;
   int inflateResult;
-  int toRead;
-
-  /* First make sure we have a large enough raw buffer to hold the
-   * decompressed data.  In practice, with a fixed BPP, fixed frame
-   * buffer size and the first update containing the entire frame
-   * buffer, this buffer allocation should only happen once, on the
-   * first update.
-   */
-  if ( raw_buffer_size < (( rw * rh ) * ( BPP / 8 ))) {
-
-    if ( raw_buffer != NULL ) {
-
-      free( raw_buffer );
-
-    }
-
-    raw_buffer_size = (( rw * rh ) * ( BPP / 8 ));
-    raw_buffer = (char*) malloc( raw_buffer_size );
-
-  }
+  unsigned int avail, used;
+  char *data;
+  int rowBytes, chunkBytes, filled, rows, rowsDone;
 
   if (!ReadFromRFBServer((char *)&hdr, sz_rfbZlibHeader))
     return False;
 
   remaining = Swap32IfLE(hdr.nBytes);
 
-  /* Need to initialize the decompressor state. */
-  decompStream.next_in   = ( Bytef * )buffer;
-  decompStream.avail_in  = 0;
-  decompStream.next_out  = ( Bytef * )raw_buffer;
-  decompStream.avail_out = raw_buffer_size;
-  decompStream.data_type = Z_BINARY;
+  /* Rows are inflated into buffer as many at a time as it holds, and
+   * copied to the screen as soon as they are complete. The largest
+   * possible row always fits.
+   */
+  rowBytes = rw * (BPP / 8);
+  if (rowBytes == 0)
+    rowBytes = 1;
+  chunkBytes = BUFFER_SIZE - BUFFER_SIZE % rowBytes;
+  filled = 0;
+  rowsDone = 0;
 
   /* Initialize the decompression stream structures on the first invocation. */
   if ( decompStreamInited == False ) {
 
+    decompStream.next_in   = Z_NULL;
+    decompStream.avail_in  = 0;
+    decompStream.zalloc    = Z_NULL;
+    decompStream.zfree     = Z_NULL;
+    decompStream.opaque    = Z_NULL;
+
     inflateResult = inflateInit( &decompStream );
 
     if ( inflateResult != Z_OK ) {
@@ -86,37 +79,62 @@ HandleZlibBPP (int rx, int ry, int rw, int rh)
 
   }
 
-  inflateResult = Z_OK;
-
-  /* Process buffer full of data until no more to process, or
-   * some type of inflater error, or Z_STREAM_END.
+  /* Inflate straight from the input buffer, as much as has arrived at a
+   * time, until all the data has been consumed.
    */
-  while (( remaining > 0 ) &&
-         ( inflateResult == Z_OK )) {
-  
-    if ( remaining > BUFFER_SIZE ) {
-      toRead = BUFFER_SIZE;
-    }
-    else {
-      toRead = remaining;
-    }
+  while ( remaining > 0 ) {
 
-    /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(buffer,toRead))
+    avail = PeekFromRFBServer(&data, 1, remaining);
+    if (avail == 0)
       return False;
 
-    decompStream.next_in  = ( Bytef * )buffer;
-    decompStream.avail_in = toRead;
-
-    /* Need to uncompress buffer full. */
-    inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
-
-    /* We never supply a dictionary for compression. */
-    if ( inflateResult == Z_NEED_DICT ) {
-      fprintf(stderr,"zlib inflate needs a dictionary!\n");
-      return False;
-    }
-    if ( inflateResult < 0 ) {
+    decompStream.next_in  = ( Bytef * )data;
+    decompStream.avail_in = avail;
+
+    do {
+      decompStream.next_out  = ( Bytef * )buffer + filled;
+      decompStream.avail_out = chunkBytes - filled;
+
+      inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
+
+      /* We never supply a dictionary for compression. */
+      if ( inflateResult == Z_NEED_DICT ) {
+        fprintf(stderr,"zlib inflate needs a dictionary!\n");
+        return False;
+      }
+      if ( inflateResult < 0 && inflateResult != Z_BUF_ERROR ) {
+        fprintf(stderr,
+                "zlib inflate returned error: %d, msg: %s\n",
+                inflateResult,
+                decompStream.msg);
+        return False;
+      }
+
+      filled = (char *)decompStream.next_out - buffer;
+      rows = filled / rowBytes;
+      if (rows > 0) {
+        if (rows > rh - rowsDone) {
+          fprintf(stderr,"zlib inflate ran out of space!\n");
+          return False;
+        }
+
+        /* Put the completed rows on the screen. */
+        CopyDataToScreen(buffer, rx, ry + rowsDone, rw, rows);
+        rowsDone += rows;
+
+        filled -= rows * rowBytes;
+        memmove(buffer, buffer + rows * rowBytes, filled);
+      }
+    } while ( inflateResult == Z_OK &&
+              ( decompStream.avail_in > 0 || decompStream.avail_out == 0 ) );
+
+    used = avail - decompStream.avail_in;
+    SkipFromRFBServer(used);
+    remaining -= used;
+
+    /* Z_BUF_ERROR only means inflate had nothing more to do. */
+    if ( inflateResult != Z_OK &&
+         ( inflateResult != Z_BUF_ERROR || used == 0 ) ) {
       fprintf(stderr,
               "zlib inflate returned error: %d, msg: %s\n",
               inflateResult,
@@ -124,34 +142,7 @@ HandleZlibBPP (int rx, int ry, int rw, int rh)
       return False;
     }
 
-    /* Result buffer allocated to be at least large enough.  We should
-     * never run out of space!
-     */
-    if (( decompStream.avail_in > 0 ) &&
-        ( decompStream.avail_out <= 0 )) {
-      fprintf(stderr,"zlib inflate ran out of space!\n");
-      return False;
-    }
-
-    remaining -= toRead;
-
   } /* while ( remaining > 0 ) */
 
-  if ( inflateResult == Z_OK ) {
-
-    /* Put the uncompressed contents of the update on the screen. */
-    CopyDataToScreen(raw_buffer, rx, ry, rw, rh);
-
-  }
-  else {
-
-    fprintf(stderr,
-            "zlib inflate returned error: %d, msg: %s\n",
-            inflateResult,
-            decompStream.msg);
-    return False;
-
-  }
-
   return True;
 }
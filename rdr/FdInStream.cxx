@@ -46,6 +46,7 @@ enum { DEFAULT_BUF_SIZE = 8192,
 
 FdInStream::FdInStream(int fd_, int timeout_, int bufSize_)
   : fd(fd_), timeout(timeout_), blockCallback(0), blockCallbackArg(0),
+    tee(0), teeArg(0),
     timing(false), timeWaitedIn100us(5), timedKbits(0),
     bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0)
 {
@@ -55,7 +56,7 @@ FdInStream::FdInStream(int fd_, int timeout_, int bufSize_)
 FdInStream::FdInStream(int fd_, void (*blockCallback_)(void*),
                        void* blockCallbackArg_, int bufSize_)
   : fd(fd_), timeout(0), blockCallback(blockCallback_),
-    blockCallbackArg(blockCallbackArg_),
+    blockCallbackArg(blockCallbackArg_), tee(0), teeArg(0),
     timing(false), timeWaitedIn100us(5), timedKbits(0),
     bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0)
 {
@@ -190,6 +191,8 @@ int FdInStream::readWithTimeoutOrCallback(void* buf, int len)
   if (n < 0) throw SystemException("read",errno);
   if (n == 0) throw EndOfStream();
 
+  if (tee) (*tee)(teeArg, buf, n);
+
   if (timing) {
     gettimeofday(&after, 0);
 //      fprintf(stderr,"%d.%06d\n",(after.tv_sec - before.tv_sec),
@@ -46,6 +46,12 @@ namespace rdr {
     unsigned int kbitsPerSecond();
     unsigned int timeWaited() { return timeWaitedIn100us; }
 
+    // setTee() has every byte read from fd passed to tee as it arrives,
+    // for recording the stream. Pass 0 to stop.
+    void setTee(void (*tee_)(void*, const void*, int), void* teeArg_=0) {
+      tee = tee_; teeArg = teeArg_;
+    }
+
   protected:
     int overrun(int itemSize, int nItems);
 
@@ -57,6 +63,8 @@ namespace rdr {
     int timeout;
     void (*blockCallback)(void*);
     void* blockCallbackArg;
+    void (*tee)(void*, const void*, int);
+    void* teeArg;
 
     bool timing;
     unsigned int timeWaitedIn100us;
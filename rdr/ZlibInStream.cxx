@@ -22,7 +22,8 @@
 
 using namespace rdr;
 
-enum { DEFAULT_BUF_SIZE = 16384 };
+enum { DEFAULT_BUF_SIZE = 16384,
+       MIN_BULK_SIZE = 1024 };
 
 ZlibInStream::ZlibInStream(int bufSize_)
   : underlying(0), bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0),
@@ -72,6 +73,91 @@ void ZlibInStream::reset()
   underlying = 0;
 }
 
+z_stream_s* ZlibInStream::copyState()
+{
+  z_stream* copy = new z_stream;
+  if (inflateCopy(copy, zs) != Z_OK) {
+    delete copy;
+    throw Exception("ZlibInStream: inflateCopy failed");
+  }
+  return copy;
+}
+
+void ZlibInStream::setState(z_stream_s* state)
+{
+  inflateEnd(zs);
+  if (inflateCopy(zs, state) != Z_OK) {
+    // Leave a usable stream behind, even though its data is lost.
+    zs->zalloc = Z_NULL;
+    zs->zfree  = Z_NULL;
+    zs->opaque = Z_NULL;
+    inflateInit(zs);
+    throw Exception("ZlibInStream: inflateCopy failed");
+  }
+}
+
+void ZlibInStream::freeState(z_stream_s* state)
+{
+  inflateEnd(state);
+  delete state;
+}
+
+int ZlibInStream::getDictionary(U8* dict)
+{
+  uInt length = 0;
+  if (inflateGetDictionary(zs, dict, &length) != Z_OK)
+    throw Exception("ZlibInStream: inflateGetDictionary failed");
+  if (zs->total_in == 0 && length == 0)
+    return -1;
+  return length;
+}
+
+void ZlibInStream::setDictionary(const U8* dict, int length)
+{
+  inflateEnd(zs);
+  zs->zalloc    = Z_NULL;
+  zs->zfree     = Z_NULL;
+  zs->opaque    = Z_NULL;
+  zs->next_in   = Z_NULL;
+  zs->avail_in  = 0;
+  if (inflateInit2(zs, -MAX_WBITS) != Z_OK)
+    throw Exception("ZlibInStream: inflateInit2 failed");
+  if (length > 0 && inflateSetDictionary(zs, dict, length) != Z_OK)
+    throw Exception("ZlibInStream: inflateSetDictionary failed");
+}
+
+// readBytes() inflates large reads straight into the caller's buffer once
+// any data already in our own buffer has been used up.
+
+void ZlibInStream::readBytes(void* data, int length)
+{
+  if (length < MIN_BULK_SIZE) {
+    InStream::readBytes(data, length);
+    return;
+  }
+
+  if (!underlying)
+    throw Exception("ZlibInStream readBytes: no underlying stream");
+
+  U8* dataPtr = (U8*)data;
+
+  int n = end - ptr;
+  if (n > length) n = length;
+
+  memcpy(dataPtr, ptr, n);
+  dataPtr += n;
+  length -= n;
+  ptr += n;
+
+  while (length > 0) {
+    U8* next = inflateTo(dataPtr, length);
+    n = next - dataPtr;
+    dataPtr += n;
+    length -= n;
+    offset += n;
+  }
+}
+
 int ZlibInStream::overrun(int itemSize, int nItems)
 {
   if (itemSize > bufSize)
@@ -101,8 +187,16 @@ int ZlibInStream::overrun(int itemSize, int nItems)
 
 void ZlibInStream::decompress()
 {
-  zs->next_out = (U8*)end;
-  zs->avail_out = start + bufSize - end;
+  end = inflateTo((U8*)end, start + bufSize - end);
+}
+
+// inflateTo() runs the decompressor once, writing up to outLen bytes at out,
+// and returns the end of the data written.
+
+U8* ZlibInStream::inflateTo(U8* out, int outLen)
+{
+  zs->next_out = out;
+  zs->avail_out = outLen;
 
   underlying->check(1);
   zs->next_in = (U8*)underlying->getptr();
@@ -116,6 +210,6 @@ void ZlibInStream::decompress()
   }
 
   bytesIn -= zs->next_in - underlying->getptr();
-  end = zs->next_out;
   underlying->setptr(zs->next_in);
+  return zs->next_out;
 }
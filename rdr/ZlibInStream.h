@@ -40,11 +40,29 @@ namespace rdr {
     void setUnderlying(InStream* is, int bytesIn);
     void reset();
     int pos();
+    void readBytes(void* data, int length);
+
+    // copyState() returns a copy of the decompressor's state, to be put
+    // back later by setState() and freed with freeState(). Use them only
+    // between reset() and the next setUnderlying().
+    z_stream_s* copyState();
+    void setState(z_stream_s* state);
+    static void freeState(z_stream_s* state);
+
+    // getDictionary() copies the decompressor's window, the last 32K it
+    // inflated, to dict and returns its length, or -1 if the stream has not
+    // been used yet. Where the data was flushed with Z_SYNC_FLUSH, that is
+    // all the next data depends on: setDictionary() starts a raw inflate
+    // stream with the window, to carry on from there. Like copyState(),
+    // use them only between reset() and the next setUnderlying().
+    int getDictionary(U8* dict);
+    void setDictionary(const U8* dict, int length);
 
   private:
 
     int overrun(int itemSize, int nItems);
     void decompress();
+    U8* inflateTo(U8* out, int outLen);
 
     InStream* underlying;
     int bufSize;
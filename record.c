@@ -0,0 +1,364 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * record.c - recording a session with -record.
+ *
+ * Everything the server sends is written to the recording file as it is
+ * read, in the FBS format used by rfbproxy and vncrec: "FBS 001.000\n",
+ * then for each read a 4-byte length, that many bytes padded to a multiple
+ * of four, and a 4-byte time in milliseconds since recording started, all
+ * big-endian. Updates are still decoded, as that is the only way to tell
+ * where one message ends, but no images are written.
+ *
+ * Alongside it go an index, the file name with ".idx" added, and keyframes,
+ * with ".key" added. The index is text: first how the session was set up,
+ * then a line for each update and each keyframe:
+ *
+ *   format BPP DEPTH BIG-ENDIAN TRUE-COLOUR RMAX GMAX BMAX RSHIFT GSHIFT BSHIFT
+ *   screen WIDTH HEIGHT
+ *   capture X Y WIDTH HEIGHT
+ *   scale N
+ *   buffer WIDTH HEIGHT COMPONENTS
+ *   start OFFSET
+ *   update TIME OFFSET
+ *   keyframe TIME OFFSET KEY-OFFSET
+ *   pointer X Y
+ *   cursor HOT-X HOT-Y WIDTH HEIGHT KEY-OFFSET
+ *   dictionary STREAM LENGTH KEY-OFFSET
+ *
+ * OFFSET is where in the server's data, not counting the FBS framing, the
+ * next message starts. A keyframe is the whole frame buffer as it was at
+ * that point, in rows of stored pixels (see StoredBufferSize()), starting
+ * KEY-OFFSET bytes into the keyframe file. The pointer and cursor lines
+ * that may follow it give the remote cursor's position and shape at the
+ * same point, the shape as stored pixels and then a mask byte for each.
+ * A dictionary line is the window of each of the decoders' zlib streams
+ * in use (see DecoderDictionary()), which is all the zlib, tight and ZRLE
+ * decoders keep between updates, so vncsnapshot-replay can decode on
+ * from any keyframe rather than from the start.
+ *
+ * A keyframe is written once the captured area has first been received
+ * and then every -fps seconds. The recording ends when the server closes
+ * the connection or, if -count is given, after that many keyframes.
+ */
+static const char *ID = "$Id$";
+
+#include "vncsnapshot.h"
+#ifdef WIN32
+#include <windows.h>	/* for GetTickCount() */
+#endif
+
+#define RECORD_BUFFER_SIZE 65536
+
+static FILE *fbsFile = NULL;
+static FILE *indexFile = NULL;
+static FILE *keyFile = NULL;
+static char *recordName = NULL;
+
+static unsigned long startTime;
+static unsigned long serverBytes = 0;	/* server data recorded */
+static unsigned long keyBytes = 0;	/* written to the keyframe file */
+static unsigned long nextKeyframe = 0;
+static int keyframes = 0;
+static Bool recordFailed = False;
+
+static FILE *OpenRecordFile(const char *filename, const char *suffix,
+			    const char *mode);
+static unsigned long RecordTime(void);
+static void RecordServerData(void *arg, const void *data, int len);
+static void PutBE32(CARD8 *p, unsigned long n);
+static unsigned long ServerOffset(void);
+static Bool WriteKeyframe(unsigned long now);
+static Bool WriteKeyframeCursor(void);
+static Bool WriteKeyframeDictionaries(void);
+
+/*
+ * StartRecording() creates the recording files and starts recording what
+ * the server sends. It is called before anything has been read from the
+ * server.
+ */
+Bool
+StartRecording(const char *filename)
+{
+  recordName = (char *) filename;
+  fbsFile = OpenRecordFile(filename, "", "wb");
+  indexFile = OpenRecordFile(filename, ".idx", "w");
+  keyFile = OpenRecordFile(filename, ".key", "wb");
+  if (fbsFile == NULL || indexFile == NULL || keyFile == NULL)
+    return False;
+
+  if (fputs("FBS 001.000\n", fbsFile) == EOF) {
+    fprintf(stderr, "%s: cannot write %s\n", programName, filename);
+    return False;
+  }
+  startTime = RecordTime();
+  SetRFBServerTee(RecordServerData);
+  return True;
+}
+
+static FILE *
+OpenRecordFile(const char *filename, const char *suffix, const char *mode)
+{
+  char *name = (char *) malloc(strlen(filename) + strlen(suffix) + 1);
+  FILE *f;
+
+  if (name == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return NULL;
+  }
+  sprintf(name, "%s%s", filename, suffix);
+  f = fopen(name, mode);
+  if (f == NULL)
+    fprintf(stderr, "%s: cannot create %s\n", programName, name);
+  else
+    setvbuf(f, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+  free(name);
+  return f;
+}
+
+/* Milliseconds since some fixed time. */
+static unsigned long
+RecordTime(void)
+{
+#ifdef WIN32
+  return GetTickCount();
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (unsigned long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/* Called with everything read from the server; see SetRFBServerTee(). */
+static void
+RecordServerData(void *arg, const void *data, int len)
+{
+  static const CARD8 zero[4] = { 0, 0, 0, 0 };
+  CARD8 word[4];
+
+  if (recordFailed)
+    return;
+
+  PutBE32(word, len);
+  fwrite(word, 1, 4, fbsFile);
+  fwrite(data, 1, len, fbsFile);
+  if (len % 4)
+    fwrite(zero, 1, 4 - len % 4, fbsFile);
+  PutBE32(word, RecordTime() - startTime);
+  if (fwrite(word, 1, 4, fbsFile) != 4) {
+    fprintf(stderr, "%s: cannot write %s\n", programName, recordName);
+    recordFailed = True;
+  }
+  serverBytes += len;
+}
+
+static void
+PutBE32(CARD8 *p, unsigned long n)
+{
+  p[0] = (CARD8) (n >> 24);
+  p[1] = (CARD8) (n >> 16);
+  p[2] = (CARD8) (n >> 8);
+  p[3] = (CARD8) n;
+}
+
+/* How much server data has been read by the decoders. */
+static unsigned long
+ServerOffset(void)
+{
+  return serverBytes - (rfbIn.end - rfbIn.ptr);
+}
+
+/*
+ * WriteRecordingHeader() starts the index, once the connection has been
+ * set up and the frame buffer allocated.
+ */
+Bool
+WriteRecordingHeader(void)
+{
+  int x, y, w, h;
+
+  fprintf(indexFile, "format %d %d %d %d %d %d %d %d %d %d\n",
+	  myFormat.bitsPerPixel, myFormat.depth, myFormat.bigEndian,
+	  myFormat.trueColour, myFormat.redMax, myFormat.greenMax,
+	  myFormat.blueMax, myFormat.redShift, myFormat.greenShift,
+	  myFormat.blueShift);
+  fprintf(indexFile, "screen %d %d\n", si.framebufferWidth,
+	  si.framebufferHeight);
+  CaptureBounds(&x, &y, &w, &h);
+  fprintf(indexFile, "capture %d %d %d %d\n", x, y, w, h);
+  fprintf(indexFile, "scale %d\n", appData.scale);
+  StoredBufferSize(&w, &h);
+  fprintf(indexFile, "buffer %d %d %d\n", w, h, BufferComponents());
+  fprintf(indexFile, "start %lu\n", ServerOffset());
+  if (ferror(indexFile)) {
+    fprintf(stderr, "%s: cannot write %s.idx\n", programName, recordName);
+    return False;
+  }
+  return True;
+}
+
+/*
+ * RecordUpdate() is called at the end of each framebuffer update. It
+ * indexes the update, writes a keyframe if one is due and asks for the
+ * next update. It returns False once the recording is over or has failed.
+ */
+Bool
+RecordUpdate(void)
+{
+  unsigned long now = RecordTime() - startTime;
+
+  fprintf(indexFile, "update %lu %lu\n", now, ServerOffset());
+
+  if (CaptureComplete() && now >= nextKeyframe) {
+    if (!WriteKeyframe(now))
+      recordFailed = True;
+    keyframes++;
+    nextKeyframe = now + appData.fps * 1000UL;
+    if (!appData.quiet)
+      fprintf(stderr, "Keyframe %d recorded at %lu.%03lus\n", keyframes,
+	      now / 1000, now % 1000);
+  }
+
+  /* A recording is often ended by interrupting it, so write out what is
+     indexed so far, the data before the index that refers to it. */
+  if (fflush(fbsFile) != 0 || fflush(keyFile) != 0) {
+    fprintf(stderr, "%s: cannot write %s\n", programName, recordName);
+    recordFailed = True;
+  }
+  if (fflush(indexFile) != 0 || ferror(indexFile)) {
+    fprintf(stderr, "%s: cannot write %s.idx\n", programName, recordName);
+    recordFailed = True;
+  }
+  if (recordFailed || (appData.count > 0 && keyframes >= appData.count))
+    return False;
+  return SendCaptureUpdateRequests(True);
+}
+
+static Bool
+WriteKeyframe(unsigned long now)
+{
+  int w, h, row;
+  size_t rowBytes;
+  char *buf;
+
+  StoredBufferSize(&w, &h);
+  rowBytes = (size_t) w * BufferComponents();
+  buf = (char *) malloc(rowBytes ? rowBytes : 1);
+  if (buf == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+
+  fprintf(indexFile, "keyframe %lu %lu %lu\n", now, ServerOffset(),
+	  keyBytes);
+  for (row = 0; row < h; row++) {
+    GetStoredBufferRow(row, buf);
+    if (fwrite(buf, 1, rowBytes, keyFile) != rowBytes) {
+      fprintf(stderr, "%s: cannot write %s.key\n", programName, recordName);
+      free(buf);
+      return False;
+    }
+  }
+  keyBytes += rowBytes * h;
+  free(buf);
+  return WriteKeyframeCursor() && WriteKeyframeDictionaries();
+}
+
+/* The remote cursor, which the frame buffer never holds. */
+static Bool
+WriteKeyframeCursor(void)
+{
+  const char *pixels;
+  const CARD8 *mask;
+  int x, y, w, h;
+  size_t n;
+
+  if (CursorPosition(&x, &y))
+    fprintf(indexFile, "pointer %d %d\n", x, y);
+  if (!CursorShape(&x, &y, &w, &h, &pixels, &mask))
+    return True;
+
+  fprintf(indexFile, "cursor %d %d %d %d %lu\n", x, y, w, h, keyBytes);
+  n = (size_t) w * h;
+  if (fwrite(pixels, BufferComponents(), n, keyFile) != n ||
+      fwrite(mask, 1, n, keyFile) != n) {
+    fprintf(stderr, "%s: cannot write %s.key\n", programName, recordName);
+    return False;
+  }
+  keyBytes += n * (BufferComponents() + 1);
+  return True;
+}
+
+/* The decoders' zlib windows, without which their next data is garbage. */
+static Bool
+WriteKeyframeDictionaries(void)
+{
+  char *dict = (char *) malloc(DECODER_DICTIONARY_SIZE);
+  unsigned int length;
+  Bool active, ok = True;
+  int i;
+
+  if (dict == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  for (i = 0; i < DECODER_STREAMS && ok; i++) {
+    ok = DecoderDictionary(i, &active, dict, &length);
+    if (!ok || !active)
+      continue;
+    fprintf(indexFile, "dictionary %d %u %lu\n", i, length, keyBytes);
+    if (fwrite(dict, 1, length, keyFile) != length) {
+      fprintf(stderr, "%s: cannot write %s.key\n", programName, recordName);
+      ok = False;
+    }
+    keyBytes += length;
+  }
+  free(dict);
+  return ok;
+}
+
+/*
+ * StopRecording() finishes the recording files. It returns whether all of
+ * the recording was written.
+ */
+Bool
+StopRecording(void)
+{
+  Bool ok = !recordFailed;
+
+  SetRFBServerTee(NULL);
+  if (fbsFile != NULL && fclose(fbsFile) != 0) {
+    fprintf(stderr, "%s: cannot write %s\n", programName, recordName);
+    ok = False;
+  }
+  if (indexFile != NULL && fclose(indexFile) != 0) {
+    fprintf(stderr, "%s: cannot write %s.idx\n", programName, recordName);
+    ok = False;
+  }
+  if (keyFile != NULL && fclose(keyFile) != 0) {
+    fprintf(stderr, "%s: cannot write %s.key\n", programName, recordName);
+    ok = False;
+  }
+  fbsFile = indexFile = keyFile = NULL;
+  if (ok && !appData.quiet)
+    fprintf(stderr, "Recorded %lu bytes from %s to %s, %d keyframe%s\n",
+	    serverBytes, vncServerName ? vncServerName : "(local host)",
+	    recordName, keyframes, keyframes == 1 ? "" : "s");
+  return ok;
+}
@@ -0,0 +1,372 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * regions.c - the parts of the screen being captured.
+ *
+ * Each region given with -region, or the -rect rectangle, or else the
+ * whole screen, is saved to its own file. Regions close together are
+ * requested from the server as one rectangle covering them all; regions
+ * far apart get a request each, so the server never sends the space
+ * between them.
+ */
+static const char *ID = "$Id$";
+
+#include "vncsnapshot.h"
+
+CaptureRegion *captureRegions = NULL;
+int numCaptureRegions = 0;
+
+/* Rectangles requested from the server. */
+typedef struct {
+  int x, y, w, h;
+} RequestArea;
+
+static RequestArea *requests = NULL;
+static int numRequests = 0;
+
+/*
+ * Rectangles asked for in full and not yet sent. One asked for while an
+ * update is being read is answered by a later update, so only rectangles
+ * arriving after the update it was asked for in count.
+ */
+typedef struct {
+  int x, y, w, h;
+  unsigned long update;	/* updates started when it was asked for */
+} PendingRect;
+
+static PendingRect *pending = NULL;
+static int numPending = 0;
+static int maxPending = 0;
+static unsigned long updatesStarted = 0;
+
+/*
+ * Two requests are merged when the rectangle covering both is at most this
+ * many pixels bigger than they are together; below that an extra request
+ * and its update cost more than the pixels saved.
+ */
+#define MERGE_SLACK (64 * 64)
+
+static void ClipCaptureRegion(CaptureRegion *r);
+static Bool AddPendingRect(int x, int y, int w, int h);
+static Bool Intersects(int x1, int y1, int w1, int h1,
+		       int x2, int y2, int w2, int h2);
+
+
+/*
+ * AddCaptureRegion() adds a region to capture; its name is inserted into
+ * the output file name, or NULL for the one saved under that name itself.
+ */
+Bool
+AddCaptureRegion(const CaptureRegion *region)
+{
+  CaptureRegion *regions;
+  int i;
+
+  for (i = 0; i < numCaptureRegions; i++) {
+    const char *name = captureRegions[i].name;
+    if (name == region->name ||
+	(name != NULL && region->name != NULL && strcmp(name, region->name) == 0)) {
+      if (region->name != NULL)
+	fprintf(stderr, "%s: region %s given twice\n", programName, region->name);
+      else
+	fprintf(stderr, "%s: only one unnamed rectangle can be captured\n",
+		programName);
+      return False;
+    }
+  }
+
+  regions = (CaptureRegion *) realloc(captureRegions, (numCaptureRegions + 1) *
+				      sizeof(CaptureRegion));
+  if (regions == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  captureRegions = regions;
+  captureRegions[numCaptureRegions++] = *region;
+  return True;
+}
+
+/*
+ * ResolveCaptureRegions() fits the regions to the screen size sent by the
+ * server and works out which rectangles to request.
+ */
+void
+ResolveCaptureRegions(void)
+{
+  int i, j;
+  Bool merged;
+
+  requests = (RequestArea *) malloc(numCaptureRegions * sizeof(RequestArea));
+  if (requests == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    exit(1);
+  }
+
+  for (i = 0; i < numCaptureRegions; i++) {
+    ClipCaptureRegion(&captureRegions[i]);
+    requests[i].x = captureRegions[i].x;
+    requests[i].y = captureRegions[i].y;
+    requests[i].w = captureRegions[i].width;
+    requests[i].h = captureRegions[i].height;
+  }
+  numRequests = numCaptureRegions;
+
+  /* Merge requests until no pair is worth merging. */
+  do {
+    merged = False;
+    for (i = 0; i < numRequests && !merged; i++) {
+      for (j = i + 1; j < numRequests && !merged; j++) {
+	RequestArea *a = &requests[i], *b = &requests[j];
+	int x = a->x < b->x ? a->x : b->x;
+	int y = a->y < b->y ? a->y : b->y;
+	int w = (a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w) - x;
+	int h = (a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h) - y;
+
+	if ((double)w * h <= (double)a->w * a->h + (double)b->w * b->h +
+	    MERGE_SLACK) {
+	  a->x = x;
+	  a->y = y;
+	  a->w = w;
+	  a->h = h;
+	  requests[j] = requests[--numRequests];
+	  merged = True;
+	}
+      }
+    }
+  } while (merged);
+
+  if (appData.debug) {
+    for (i = 0; i < numRequests; i++)
+      fprintf(stderr, "Requesting %dx%d+%d+%d\n", requests[i].w, requests[i].h,
+	      requests[i].x, requests[i].y);
+  }
+}
+
+/*
+ * Negative X/Y implies from opposite edge; width/height of 0 means to
+ * edge. Anything off the screen is pulled back onto it.
+ */
+static void
+ClipCaptureRegion(CaptureRegion *r)
+{
+  if (r->x < 0) {
+    r->x = si.framebufferWidth + r->x;
+  } else if (r->xNegative) {
+    r->x = si.framebufferWidth - r->x - r->width;
+  }
+  if (r->y < 0) {
+    r->y = si.framebufferHeight + r->y;
+  } else if (r->yNegative) {
+    r->y = si.framebufferHeight - r->y - r->height;
+  }
+  if (r->x >= si.framebufferWidth || r->x < 0) {
+    fprintf(stderr, "%s: Requested rectangle x <%ld> is outside screen width <%d>, using 0\n",
+	    programName, r->x, si.framebufferWidth);
+    r->x = 0;
+  }
+  if (r->y >= si.framebufferHeight || r->y < 0) {
+    fprintf(stderr, "%s: Requested rectangle y <%ld> is outside screen height <%d>, using 0\n",
+	    programName, r->y, si.framebufferHeight);
+    r->y = 0;
+  }
+
+  if (r->width == 0) {
+    r->width = si.framebufferWidth - r->x;
+  }
+  if (r->height == 0) {
+    r->height = si.framebufferHeight - r->y;
+  }
+  if (r->width <= 0 || r->width > si.framebufferWidth - r->x) {
+    fprintf(stderr, "%s: Requested rectangle width <%ld> plus offset <%ld> is wider than screen width <%d>, using %ld\n",
+	    programName, r->width, r->x, si.framebufferWidth, si.framebufferWidth - r->x);
+    r->width = si.framebufferWidth - r->x;
+  }
+  if (r->height <= 0 || r->height > si.framebufferHeight - r->y) {
+    fprintf(stderr, "%s: Requested rectangle height <%ld> plus offset <%ld> is wider than screen height <%d>, using %ld\n",
+	    programName, r->height, r->y, si.framebufferHeight, si.framebufferHeight - r->y);
+    r->height = si.framebufferHeight - r->y;
+  }
+  r->xNegative = r->yNegative = 0;
+}
+
+/* The smallest rectangle covering every region. */
+void
+CaptureBounds(int *x, int *y, int *w, int *h)
+{
+  int i, x2, y2;
+
+  *x = si.framebufferWidth;
+  *y = si.framebufferHeight;
+  x2 = y2 = 0;
+  for (i = 0; i < numRequests; i++) {
+    if (requests[i].x < *x)
+      *x = requests[i].x;
+    if (requests[i].y < *y)
+      *y = requests[i].y;
+    if (requests[i].x + requests[i].w > x2)
+      x2 = requests[i].x + requests[i].w;
+    if (requests[i].y + requests[i].h > y2)
+      y2 = requests[i].y + requests[i].h;
+  }
+  if (x2 <= *x || y2 <= *y) {
+    *x = *y = 0;
+    x2 = y2 = 0;
+  }
+  *w = x2 - *x;
+  *h = y2 - *y;
+}
+
+/*
+ * Ask for the captured parts of the screen. After a full (not incremental)
+ * request CaptureComplete() is False until every requested rectangle has
+ * been sent something.
+ */
+Bool
+SendCaptureUpdateRequests(Bool incremental)
+{
+  int i;
+
+  if (!incremental)
+    numPending = 0;
+  for (i = 0; i < numRequests; i++) {
+    if (!SendFramebufferUpdateRequest(requests[i].x, requests[i].y,
+				      requests[i].w, requests[i].h,
+				      incremental))
+      return False;
+    if (!incremental &&
+	!AddPendingRect(requests[i].x, requests[i].y,
+			requests[i].w, requests[i].h))
+      return False;
+  }
+  return True;
+}
+
+/*
+ * RequestCaptureRect() asks again, in full, for the captured part of a
+ * rectangle whose pixels could not be worked out from what was received,
+ * such as a CopyRect from outside the capture. CaptureComplete() waits for
+ * it.
+ */
+Bool
+RequestCaptureRect(int x, int y, int w, int h)
+{
+  int i;
+
+  for (i = 0; i < numRequests; i++) {
+    RequestArea *a = &requests[i];
+    int x1 = x > a->x ? x : a->x;
+    int y1 = y > a->y ? y : a->y;
+    int x2 = x + w < a->x + a->w ? x + w : a->x + a->w;
+    int y2 = y + h < a->y + a->h ? y + h : a->y + a->h;
+
+    if (x2 <= x1 || y2 <= y1)
+      continue;
+    if (appData.debug)
+      fprintf(stderr, "Requesting again %dx%d+%d+%d\n", x2 - x1, y2 - y1,
+	      x1, y1);
+    if (!SendFramebufferUpdateRequest(x1, y1, x2 - x1, y2 - y1, False) ||
+	!AddPendingRect(x1, y1, x2 - x1, y2 - y1))
+      return False;
+  }
+  return True;
+}
+
+static Bool
+AddPendingRect(int x, int y, int w, int h)
+{
+  if (numPending == maxPending) {
+    int n = maxPending ? maxPending * 2 : 16;
+    PendingRect *p = (PendingRect *) realloc(pending, n * sizeof(PendingRect));
+    if (p == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      return False;
+    }
+    pending = p;
+    maxPending = n;
+  }
+  pending[numPending].x = x;
+  pending[numPending].y = y;
+  pending[numPending].w = w;
+  pending[numPending].h = h;
+  pending[numPending].update = updatesStarted;
+  numPending++;
+  return True;
+}
+
+static Bool
+Intersects(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2)
+{
+  return x1 < x2 + w2 && x2 < x1 + w1 && y1 < y2 + h2 && y2 < y1 + h1;
+}
+
+/* Whether a rectangle sent by the server touches anything requested. */
+Bool
+RectInCapture(int x, int y, int w, int h)
+{
+  int i;
+
+  for (i = 0; i < numRequests; i++) {
+    if (Intersects(x, y, w, h, requests[i].x, requests[i].y,
+		   requests[i].w, requests[i].h))
+      return True;
+  }
+  return False;
+}
+
+/* Whether a rectangle lies wholly inside one requested rectangle. */
+Bool
+RectInsideCapture(int x, int y, int w, int h)
+{
+  int i;
+
+  for (i = 0; i < numRequests; i++) {
+    if (x >= requests[i].x && y >= requests[i].y &&
+	x + w <= requests[i].x + requests[i].w &&
+	y + h <= requests[i].y + requests[i].h)
+      return True;
+  }
+  return False;
+}
+
+/* Called as each framebuffer update message starts. */
+void
+CaptureUpdateStarted(void)
+{
+  updatesStarted++;
+}
+
+void
+CaptureRectReceived(int x, int y, int w, int h)
+{
+  int i;
+
+  for (i = 0; i < numPending; ) {
+    PendingRect *p = &pending[i];
+    if (p->update < updatesStarted &&
+	Intersects(x, y, w, h, p->x, p->y, p->w, p->h))
+      *p = pending[--numPending];
+    else
+      i++;
+  }
+}
+
+Bool
+CaptureComplete(void)
+{
+  return numPending == 0;
+}
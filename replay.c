@@ -0,0 +1,843 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * replay.c - vncsnapshot-replay, which saves snapshots from a recording.
+ *
+ * The recording is an FBS file, as written by vncsnapshot -record, or a
+ * raw dump of what a server sent to a protocol 3.3 client. It is read into
+ * memory and decoded by the same code as a live session, with nothing
+ * sent back.
+ *
+ * Each snapshot asked for is made by going back to the last checkpoint
+ * before it and decoding on from there. If vncsnapshot -record's index is
+ * alongside, the pixel format, capture rectangle and scale are taken from
+ * it, as are where and when each update ends, and the checkpoints are the
+ * start and the keyframes (see record.c).
+ * Without one, a first pass decodes the whole recording to find the
+ * updates, keeping checkpoints of the frame buffer, the cursor and the
+ * decoders' zlib streams in memory along the way.
+ */
+static const char *ID = "$Id$";
+
+#include <time.h>
+
+#include "vncsnapshot.h"
+
+char *programName;
+
+/* The end of each update, in bytes of server data and in milliseconds. */
+typedef struct {
+  unsigned long offset;
+  unsigned long time;
+} UpdateEnd;
+
+/* A keyframe from the index, with the cursor and the decoders' zlib
+   windows as they were then. */
+typedef struct {
+  int update;		/* updates before it */
+  unsigned long offset, keyOffset;
+  Bool pointerSet, shapeSet;
+  int pointerX, pointerY;
+  int hotX, hotY, width, height;
+  unsigned long shapeOffset;
+  Bool dictSet[DECODER_STREAMS];
+  unsigned int dictLength[DECODER_STREAMS];
+  unsigned long dictOffset[DECODER_STREAMS];
+} Keyframe;
+
+/* Everything needed to carry on decoding from the end of an update, kept
+   in memory or, for a keyframe, in the keyframe file. */
+typedef struct {
+  int update;		/* updates decoded before it */
+  unsigned long offset;
+  void *buffer, *cursor, *decoder;
+  Keyframe *keyframe;
+} Checkpoint;
+
+/* A snapshot asked for on the command line. */
+typedef struct {
+  char *arg;		/* as given */
+  Bool byTime;		/* -at, rather than -update */
+  double seconds;
+  int update;
+} ReplayPoint;
+
+static char *stream;		/* the server data */
+static unsigned long streamLength;
+static unsigned long *blockEnds;	/* FBS blocks, NULL for a raw dump */
+static unsigned long *blockTimes;
+static int numBlocks = 0;
+
+static UpdateEnd *updateEnds = NULL;
+static int numUpdates = 0, maxUpdates = 0;
+static Checkpoint *checkpoints = NULL;
+static int numCheckpoints = 0, maxCheckpoints = 16;
+
+/* What the index says; indexStart is where it says updates start. */
+static Bool indexed = False;
+static unsigned long indexStart;
+static int indexWidth, indexHeight, indexComponents;
+static Keyframe *keyframes = NULL;
+static int numKeyframes = 0;
+static FILE *keyFile = NULL;
+static char *keyName = NULL;
+
+static ReplayPoint *points = NULL;
+static int numPoints = 0;
+static Bool partialUpdate = False;	/* part of an update has been decoded */
+
+static void replayUsage(void);
+static Bool ReadRecording(const char *filename);
+static void ReadIndex(const char *filename, rfbPixelFormat *format);
+static void CheckIndex(const char *filename);
+static Bool AddUpdateEnd(unsigned long offset, unsigned long time);
+static unsigned long BlockTime(unsigned long offset);
+static Bool AddPoint(char *arg, Bool byTime);
+static Checkpoint *NewCheckpoint(void);
+static Bool AddCheckpoint(void);
+static Bool RestoreCheckpoint(Checkpoint *c);
+static Bool LoadKeyframe(Keyframe *k);
+static Bool StartReplay(unsigned long offset);
+static Bool DecodeUpdates(int last, Bool firstPass);
+static double Seconds(void);
+
+
+int
+main(int argc, char **argv)
+{
+  char *recording, *filename = NULL;
+  rfbPixelFormat format;
+  int i, x, y, w, h;
+  double start, seconds;
+
+  programName = argv[0];
+
+  appData.useRemoteCursor = 1;
+  appData.ignoreBlank = 0;
+  appData.nullPassword = True;
+
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    if (strcmp(argv[i], "-at") == 0 && i + 1 < argc) {
+      if (!AddPoint(argv[++i], True)) replayUsage();
+    } else if (strcmp(argv[i], "-update") == 0 && i + 1 < argc) {
+      if (!AddPoint(argv[++i], False)) replayUsage();
+    } else if (strcmp(argv[i], "-bpp") == 0 && i + 1 < argc) {
+      appData.bitsPerPixel = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-checkpoints") == 0 && i + 1 < argc) {
+      maxCheckpoints = atoi(argv[++i]);
+      if (maxCheckpoints < 1) replayUsage();
+    } else if (strcmp(argv[i], "-quality") == 0 && i + 1 < argc) {
+      appData.saveQuality = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-nocursor") == 0) {
+      appData.useRemoteCursor = 0;
+    } else if (strcmp(argv[i], "-stats") == 0) {
+      decodeStats = True;
+    } else if (strcmp(argv[i], "-tiled") == 0) {
+      appData.tiled = True;
+    } else if (strcmp(argv[i], "-quiet") == 0) {
+      appData.quiet = True;
+    } else {
+      replayUsage();
+    }
+  }
+  if (i == argc || argc - i > 2)
+    replayUsage();
+  recording = argv[i];
+  if (i + 1 < argc)
+    filename = argv[i + 1];
+  if (numPoints > 0 && filename == NULL)
+    replayUsage();
+
+  if (!ReadRecording(recording))
+    exit(1);
+  memset(&format, 0, sizeof(format));
+  ReadIndex(recording, &format);
+
+  /* The start of the session, up to the first message after ServerInit,
+     is decoded just as when connecting. */
+  if (!StartReplay(0) || !InitialiseRFBConnection())
+    exit(1);
+  if (numCaptureRegions == 0) {
+    CaptureRegion region;
+
+    memset(&region, 0, sizeof(region));
+    AddCaptureRegion(&region);
+  }
+  ResolveCaptureRegions();
+  if (!AllocateBuffer())
+    exit(1);
+  if (format.bitsPerPixel != 0 &&
+      (format.bitsPerPixel != myFormat.bitsPerPixel ||
+       format.redShift != myFormat.redShift ||
+       format.greenShift != myFormat.greenShift ||
+       format.blueShift != myFormat.blueShift)) {
+    fprintf(stderr, "%s: %s was recorded with a pixel format this machine "
+	    "does not use\n", programName, recording);
+    exit(1);
+  }
+  CheckIndex(recording);
+  if (numBlocks == 0 && !indexed) {
+    for (i = 0; i < numPoints; i++) {
+      if (points[i].byTime) {
+	fprintf(stderr, "%s: %s holds no times; use -update\n", programName,
+		recording);
+	exit(1);
+      }
+    }
+  }
+
+  /* The start is always a checkpoint, then the index's keyframes. */
+  if (!AddCheckpoint())
+    exit(1);
+  for (i = 0; i < numKeyframes; i++) {
+    Checkpoint *c = NewCheckpoint();
+
+    if (c == NULL)
+      exit(1);
+    c->update = keyframes[i].update;
+    c->offset = keyframes[i].offset;
+    c->keyframe = &keyframes[i];
+  }
+  if (indexed && !appData.quiet) {
+    fprintf(stderr, "%d updates and %d keyframes to start from in the "
+	    "index\n", numUpdates, numKeyframes);
+  }
+
+  /* Without an index, a first pass finds every update and keeps
+     checkpoints along the way. With one it is only needed for -stats,
+     or to time decoding the whole recording. */
+  if (!indexed || decodeStats || filename == NULL) {
+    start = Seconds();
+    if (!DecodeUpdates(-1, !indexed))
+      exit(1);
+    seconds = Seconds() - start;
+    if (!appData.quiet || decodeStats) {
+      fprintf(stderr, "%d updates, %.2f MB of server data decoded in %.3f "
+	      "seconds, %.2f MB/s, %d checkpoints\n", numUpdates,
+	      streamLength / 1e6, seconds,
+	      seconds > 0 ? streamLength / 1e6 / seconds : 0.0, numCheckpoints);
+    }
+    if (decodeStats)
+      PrintDecodeStats(stderr);
+  }
+
+  if (filename == NULL)
+    return 0;
+  if (numPoints == 0) {
+    /* The screen as it was at the end. */
+    if (!AddPoint(NULL, False))
+      exit(1);
+    points[0].update = numUpdates;
+  }
+
+  CaptureBounds(&x, &y, &w, &h);
+  for (i = 0; i < numPoints; i++) {
+    ReplayPoint *p = &points[i];
+    Checkpoint *c;
+    int update = p->update;
+    char *name, *token;
+    int j;
+
+    if (p->byTime) {
+      unsigned long ms = (unsigned long)(p->seconds * 1000 + 0.5);
+
+      for (update = 0; update < numUpdates; update++) {
+	if (updateEnds[update].time > ms)
+	  break;
+      }
+    } else if (update > numUpdates) {
+      fprintf(stderr, "%s: %s holds only %d updates\n", programName,
+	      recording, numUpdates);
+      exit(1);
+    }
+
+    /* Go back to the last checkpoint at or before the update wanted, unless
+       decoding is already between the two. */
+    for (j = numCheckpoints - 1; j > 0; j--) {
+      if (checkpoints[j].update <= update)
+	break;
+    }
+    c = &checkpoints[j];
+    if (partialUpdate || (int)updatesDecoded < c->update ||
+	(int)updatesDecoded > update) {
+      if (!RestoreCheckpoint(c))
+	exit(1);
+    }
+    if (!DecodeUpdates(update, False))
+      exit(1);
+
+    if (numPoints == 1) {
+      name = filename;
+    } else {
+      token = (char *) malloc(strlen(p->arg) + 2);
+      if (token == NULL) {
+	fprintf(stderr, "%s: out of memory\n", programName);
+	exit(1);
+      }
+      sprintf(token, "%s%s", p->byTime ? "" : "u", p->arg);
+      if (p->byTime)
+	strcat(token, "s");
+      name = OutputFileName(filename, token);
+      free(token);
+      if (name == NULL) {
+	fprintf(stderr, "%s: out of memory\n", programName);
+	exit(1);
+      }
+    }
+    if (!WriteSnapshot(name, x, y, w, h))
+      exit(1);
+    if (!appData.quiet) {
+      fprintf(stderr, "Image saved from %s after update %d", recording,
+	      update);
+      if ((numBlocks > 0 || indexed) && update > 0)
+	fprintf(stderr, " at %lu.%03lus", updateEnds[update - 1].time / 1000,
+		updateEnds[update - 1].time % 1000);
+      fprintf(stderr, " to %s\n", name);
+    }
+    if (name != filename)
+      free(name);
+  }
+
+  for (i = 0; i < numCheckpoints; i++) {
+    if (checkpoints[i].keyframe != NULL)
+      continue;
+    FreeBufferState(checkpoints[i].buffer);
+    FreeCursorState(checkpoints[i].cursor);
+    FreeDecoderState(checkpoints[i].decoder);
+  }
+  if (keyFile != NULL)
+    fclose(keyFile);
+  return 0;
+}
+
+static void
+replayUsage(void)
+{
+  fprintf(stderr,
+	  "Usage: %s [<OPTIONS>] recording [filename]\n"
+	  "\n"
+	  "Saves snapshots from a recording made with vncsnapshot -record, or\n"
+	  "from a raw dump of what a VNC server sent. Without a filename the\n"
+	  "recording is only decoded, to time it.\n"
+	  "\n"
+	  "<OPTIONS> are:\n"
+	  "        -at <SECONDS>: save the screen as it was this far into the recording\n"
+	  "        -update <N>: save the screen as it was after N updates\n"
+	  "        -bpp <BITS>: pixel size vncsnapshot asked for, if there is no index (default 32)\n"
+	  "        -checkpoints <N>: without an index, keep at most about N checkpoints (default 16)\n"
+	  "        -quality <JPEG-QUALITY-VALUE>: output file quality level, percent (0..100)\n"
+	  "        -nocursor: do not draw the remote cursor\n"
+	  "        -stats: report decoding speed for each encoding\n"
+	  "        -tiled: keep the frame buffer in 64x64 tiles\n"
+	  "        -quiet: do not output messages\n"
+	  "\n"
+	  "-at and -update may be given more than once; each snapshot then goes\n"
+	  "to the file name with -<SECONDS>s or -u<N> before the extension.\n",
+	  programName);
+  exit(1);
+}
+
+/*
+ * Read the recording into memory. An FBS file's blocks are joined, and
+ * where each ends and its time kept.
+ */
+static Bool
+ReadRecording(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  char *data;
+  long len;
+  unsigned long p;
+
+  if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "%s: cannot read %s\n", programName, filename);
+    return False;
+  }
+  data = (char *) malloc(len ? len : 1);
+  if (data == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  if (fread(data, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "%s: cannot read %s\n", programName, filename);
+    return False;
+  }
+  fclose(f);
+
+  if (len < 12 || memcmp(data, "FBS 001.", 8) != 0) {
+    stream = data;
+    streamLength = len;
+    return True;
+  }
+
+  /* Blocks are at least 8 bytes, so there are at most len / 8 of them. */
+  stream = (char *) malloc(len);
+  blockEnds = (unsigned long *) malloc((len / 8 + 1) * sizeof(unsigned long));
+  blockTimes = (unsigned long *) malloc((len / 8 + 1) * sizeof(unsigned long));
+  if (stream == NULL || blockEnds == NULL || blockTimes == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  streamLength = 0;
+  for (p = 12; p + 4 <= (unsigned long)len; ) {
+    CARD8 *b = (CARD8 *)data + p;
+    unsigned long n = (unsigned long)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    unsigned long padded = (n + 3) & ~3UL;
+
+    if (padded + 8 > len - p) {
+      fprintf(stderr, "%s: %s ends partway through a block\n", programName,
+	      filename);
+      break;
+    }
+    memcpy(stream + streamLength, b + 4, n);
+    streamLength += n;
+    b += 4 + padded;
+    blockEnds[numBlocks] = streamLength;
+    blockTimes[numBlocks++] =
+      (unsigned long)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    p += padded + 8;
+  }
+  free(data);
+  return True;
+}
+
+/*
+ * Take what the session was set up with from the index, if there is one,
+ * and where and when each update ends and the keyframes. CheckIndex()
+ * decides whether it can be used.
+ */
+static void
+ReadIndex(const char *filename, rfbPixelFormat *format)
+{
+  char *name = (char *) malloc(strlen(filename) + 5);
+  char line[256], word[16];
+  FILE *f;
+  int v[10];
+  unsigned long t, off, keyOff;
+  unsigned int length;
+  int last = -1;	/* the keyframe the lines after it belong to */
+  Bool haveStart = False, haveBuffer = False;
+
+  if (name == NULL)
+    return;
+  sprintf(name, "%s.idx", filename);
+  f = fopen(name, "r");
+  free(name);
+  if (f == NULL)
+    return;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%15s", word) != 1)
+      continue;
+    if (strcmp(word, "update") == 0 &&
+	sscanf(line, "%*s %lu %lu", &t, &off) == 2) {
+      if (!AddUpdateEnd(off, t))
+	exit(1);
+    } else if (strcmp(word, "keyframe") == 0 &&
+	       sscanf(line, "%*s %lu %lu %lu", &t, &off, &keyOff) == 3) {
+      Keyframe *k;
+
+      k = (Keyframe *) realloc(keyframes,
+			       (numKeyframes + 1) * sizeof(Keyframe));
+      if (k == NULL) {
+	fprintf(stderr, "%s: out of memory\n", programName);
+	exit(1);
+      }
+      keyframes = k;
+      k = &keyframes[numKeyframes];
+      memset(k, 0, sizeof(Keyframe));
+      k->update = numUpdates;
+      k->offset = off;
+      k->keyOffset = keyOff;
+      last = numKeyframes++;
+    } else if (strcmp(word, "pointer") == 0 &&
+	       sscanf(line, "%*s %d %d", &v[0], &v[1]) == 2) {
+      if (last >= 0) {
+	keyframes[last].pointerSet = True;
+	keyframes[last].pointerX = v[0];
+	keyframes[last].pointerY = v[1];
+      }
+    } else if (strcmp(word, "cursor") == 0 &&
+	       sscanf(line, "%*s %d %d %d %d %lu", &v[0], &v[1], &v[2], &v[3],
+		      &off) == 5) {
+      if (last >= 0 && v[2] >= 0 && v[3] >= 0) {
+	keyframes[last].shapeSet = True;
+	keyframes[last].hotX = v[0];
+	keyframes[last].hotY = v[1];
+	keyframes[last].width = v[2];
+	keyframes[last].height = v[3];
+	keyframes[last].shapeOffset = off;
+      }
+    } else if (strcmp(word, "dictionary") == 0 &&
+	       sscanf(line, "%*s %d %u %lu", &v[0], &length, &off) == 3) {
+      if (last >= 0 && v[0] >= 0 && v[0] < DECODER_STREAMS &&
+	  length <= DECODER_DICTIONARY_SIZE) {
+	keyframes[last].dictSet[v[0]] = True;
+	keyframes[last].dictLength[v[0]] = length;
+	keyframes[last].dictOffset[v[0]] = off;
+      }
+    } else if (strcmp(word, "format") == 0 &&
+	sscanf(line, "%*s %d %d %d %d %d %d %d %d %d %d", &v[0], &v[1], &v[2],
+	       &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]) == 10) {
+      format->bitsPerPixel = v[0];
+      format->redShift = v[7];
+      format->greenShift = v[8];
+      format->blueShift = v[9];
+      appData.bitsPerPixel = v[0];
+    } else if (strcmp(word, "capture") == 0 &&
+	       sscanf(line, "%*s %d %d %d %d", &v[0], &v[1], &v[2], &v[3]) == 4 &&
+	       v[2] > 0 && v[3] > 0) {
+      CaptureRegion region;
+
+      memset(&region, 0, sizeof(region));
+      region.x = v[0];
+      region.y = v[1];
+      region.width = v[2];
+      region.height = v[3];
+      AddCaptureRegion(&region);
+    } else if (strcmp(word, "scale") == 0 &&
+	       sscanf(line, "%*s %d", &v[0]) == 1) {
+      appData.scale = v[0];
+    } else if (strcmp(word, "buffer") == 0 &&
+	       sscanf(line, "%*s %d %d %d", &v[0], &v[1], &v[2]) == 3) {
+      appData.grayscale = v[2] == 1;
+      indexWidth = v[0];
+      indexHeight = v[1];
+      indexComponents = v[2];
+      haveBuffer = True;
+    } else if (strcmp(word, "start") == 0 &&
+	       sscanf(line, "%*s %lu", &indexStart) == 1) {
+      haveStart = True;
+    }
+  }
+  fclose(f);
+  indexed = haveStart && haveBuffer;
+}
+
+/*
+ * Once the session has been set up, check the index is for it, drop what
+ * it says about data the recording does not hold, and open the keyframe
+ * file. Without a usable index everything is found by decoding instead.
+ */
+static void
+CheckIndex(const char *filename)
+{
+  int w, h;
+
+  StoredBufferSize(&w, &h);
+  if (indexed && (RFBServerOffset() != indexStart || w != indexWidth ||
+		  h != indexHeight || BufferComponents() != indexComponents)) {
+    fprintf(stderr, "%s: %s.idx does not match %s; not using it\n",
+	    programName, filename, filename);
+    indexed = False;
+  }
+  if (!indexed) {
+    numUpdates = 0;
+    numKeyframes = 0;
+    return;
+  }
+
+  /* A recording can be cut off after its index was written. */
+  while (numUpdates > 0 && updateEnds[numUpdates - 1].offset > streamLength)
+    numUpdates--;
+  while (numKeyframes > 0 &&
+	 (keyframes[numKeyframes - 1].offset > streamLength ||
+	  keyframes[numKeyframes - 1].update > numUpdates))
+    numKeyframes--;
+
+  if (numKeyframes > 0) {
+    keyName = (char *) malloc(strlen(filename) + 5);
+    if (keyName == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      exit(1);
+    }
+    sprintf(keyName, "%s.key", filename);
+    keyFile = fopen(keyName, "rb");
+    if (keyFile == NULL) {
+      fprintf(stderr, "%s: cannot read %s; decoding from the start\n",
+	      programName, keyName);
+      numKeyframes = 0;
+    }
+  }
+}
+
+/* Note where and when an update ends. */
+static Bool
+AddUpdateEnd(unsigned long offset, unsigned long time)
+{
+  UpdateEnd *u;
+
+  if (numUpdates == maxUpdates) {
+    maxUpdates = maxUpdates ? maxUpdates * 2 : 256;
+    u = (UpdateEnd *) realloc(updateEnds, maxUpdates * sizeof(UpdateEnd));
+    if (u == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      return False;
+    }
+    updateEnds = u;
+  }
+  u = &updateEnds[numUpdates++];
+  u->offset = offset;
+  u->time = time;
+  return True;
+}
+
+/* The time of the FBS block holding the byte before offset. */
+static unsigned long
+BlockTime(unsigned long offset)
+{
+  int lo = 0, hi = numBlocks - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (blockEnds[mid] >= offset)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return blockTimes[lo];
+}
+
+static Bool
+AddPoint(char *arg, Bool byTime)
+{
+  ReplayPoint *p;
+  char *end = NULL;
+
+  p = (ReplayPoint *) realloc(points, (numPoints + 1) * sizeof(ReplayPoint));
+  if (p == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    exit(1);
+  }
+  points = p;
+  p = &points[numPoints];
+  p->arg = arg;
+  p->byTime = byTime;
+  p->seconds = 0;
+  p->update = 0;
+  if (arg != NULL) {
+    if (byTime)
+      p->seconds = strtod(arg, &end);
+    else
+      p->update = (int)strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || p->seconds < 0 || p->update < 0)
+      return False;
+  }
+  numPoints++;
+  return True;
+}
+
+static Checkpoint *
+NewCheckpoint(void)
+{
+  Checkpoint *c;
+
+  if (numCheckpoints == 0 || numCheckpoints % 16 == 0) {
+    c = (Checkpoint *) realloc(checkpoints,
+			       (numCheckpoints + 16) * sizeof(Checkpoint));
+    if (c == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      return NULL;
+    }
+    checkpoints = c;
+  }
+  c = &checkpoints[numCheckpoints++];
+  memset(c, 0, sizeof(Checkpoint));
+  return c;
+}
+
+/* Keep what is needed to carry on from here. */
+static Bool
+AddCheckpoint(void)
+{
+  Checkpoint *c = NewCheckpoint();
+
+  if (c == NULL)
+    return False;
+  c->update = updatesDecoded;
+  c->offset = RFBServerOffset();
+  c->buffer = SaveBufferState();
+  c->cursor = SaveCursorState();
+  c->decoder = SaveDecoderState();
+  if (c->buffer == NULL || c->cursor == NULL || c->decoder == NULL) {
+    fprintf(stderr, "%s: out of memory for checkpoint %d\n", programName,
+	    numCheckpoints);
+    return False;
+  }
+  return True;
+}
+
+/*
+ * Go back to a checkpoint. A keyframe's is the start's, with the frame
+ * buffer, the cursor and the decoders' zlib windows as the keyframe file
+ * has them: nothing else carries over from one update to the next.
+ */
+static Bool
+RestoreCheckpoint(Checkpoint *c)
+{
+  Checkpoint *s = c->keyframe != NULL ? &checkpoints[0] : c;
+
+  RestoreBufferState(s->buffer);
+  if (!RestoreCursorState(s->cursor) || !RestoreDecoderState(s->decoder) ||
+      (c->keyframe != NULL && !LoadKeyframe(c->keyframe)) ||
+      !StartReplay(c->offset))
+    return False;
+  updatesDecoded = c->update;
+  partialUpdate = False;
+  return True;
+}
+
+static Bool
+LoadKeyframe(Keyframe *k)
+{
+  int w, h, row, i;
+  size_t rowBytes, n;
+  char *buf;
+  CARD8 *mask;
+  Bool ok = True;
+
+  StoredBufferSize(&w, &h);
+  rowBytes = (size_t) w * BufferComponents();
+  buf = (char *) malloc(rowBytes ? rowBytes : 1);
+  if (buf == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return False;
+  }
+  if (fseek(keyFile, (long) k->keyOffset, SEEK_SET) != 0)
+    ok = False;
+  for (row = 0; ok && row < h; row++) {
+    if (fread(buf, 1, rowBytes, keyFile) != rowBytes)
+      ok = False;
+    else
+      PutStoredBufferRow(row, buf);
+  }
+  free(buf);
+
+  if (ok && k->pointerSet)
+    HandleCursorPos(k->pointerX, k->pointerY);
+  if (ok && k->shapeSet) {
+    n = (size_t) k->width * k->height;
+    buf = (char *) malloc(n * BufferComponents() + 1);
+    mask = (CARD8 *) malloc(n + 1);
+    if (buf == NULL || mask == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      free(buf);
+      free(mask);
+      return False;
+    }
+    ok = fseek(keyFile, (long) k->shapeOffset, SEEK_SET) == 0 &&
+      fread(buf, BufferComponents(), n, keyFile) == n &&
+      fread(mask, 1, n, keyFile) == n;
+    if (ok && !SetCursorShape(k->hotX, k->hotY, k->width, k->height, buf,
+			      mask)) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      free(buf);
+      free(mask);
+      return False;
+    }
+    free(buf);
+    free(mask);
+  }
+
+  if (ok) {
+    buf = (char *) malloc(DECODER_DICTIONARY_SIZE);
+    if (buf == NULL) {
+      fprintf(stderr, "%s: out of memory\n", programName);
+      return False;
+    }
+    for (i = 0; ok && i < DECODER_STREAMS; i++) {
+      if (!k->dictSet[i])
+	continue;
+      if (fseek(keyFile, (long) k->dictOffset[i], SEEK_SET) != 0 ||
+	  fread(buf, 1, k->dictLength[i], keyFile) != k->dictLength[i]) {
+	ok = False;
+      } else if (!SetDecoderDictionary(i, buf, k->dictLength[i])) {
+	free(buf);
+	return False;
+      }
+    }
+    free(buf);
+  }
+  if (!ok)
+    fprintf(stderr, "%s: cannot read %s\n", programName, keyName);
+  return ok;
+}
+
+/* Decode server data from offset on. */
+static Bool
+StartReplay(unsigned long offset)
+{
+  return SetRFBServerData(stream, streamLength) &&
+    (offset == 0 || (SkipFromRFBServer(offset), True));
+}
+
+/*
+ * Decode until last updates have been decoded, or to the end of the
+ * recording if last is negative, when a message cut off at the end is not
+ * an error. With the first pass, note where each update ends and add a
+ * checkpoint every so often.
+ */
+static Bool
+DecodeUpdates(int last, Bool firstPass)
+{
+  unsigned long interval = streamLength / maxCheckpoints + 1;
+
+  while (last < 0 || (int)updatesDecoded < last) {
+    unsigned long before = updatesDecoded;
+    unsigned long offset = RFBServerOffset();
+    Bool ok;
+
+    if (offset == streamLength)
+      return last < 0;
+    ok = HandleRFBServerMessage();
+    if (updatesDecoded != before && firstPass) {
+      unsigned long end = RFBServerOffset();
+
+      if (!AddUpdateEnd(end, numBlocks > 0 ? BlockTime(end) : 0))
+	return False;
+      if (end >= checkpoints[numCheckpoints - 1].offset + interval &&
+	  !AddCheckpoint())
+	return False;
+    } else if (updatesDecoded == before && !ok) {
+      if (last < 0) {
+	/* Usually a recording cut off partway through a message. */
+	fprintf(stderr, "%s: cannot decode the last %lu bytes\n",
+		programName, streamLength - offset);
+	partialUpdate = True;
+	return True;
+      }
+      return False;
+    }
+  }
+  return True;
+}
+
+static double
+Seconds(void)
+{
+#ifdef WIN32
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
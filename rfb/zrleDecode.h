@@ -24,9 +24,14 @@
 // BPP should be 8, 16 or 32 depending on the bits per pixel.
 // FILL_RECT
 // IMAGE_RECT
+//
+// Alternatively, with CPIXEL 24A, define ZRLE_RGB24 instead of FILL_RECT and
+// IMAGE_RECT to write the three bytes of each pixel straight into a packed
+// frame buffer at fb, stride bytes per row.
 
 #include <rdr/ZlibInStream.h>
 #include <rdr/InStream.h>
+#include <rdr/Exception.h>
 #include <assert.h>
 
 using namespace rdr;
@@ -39,21 +44,154 @@ using namespace rdr;
 #define __RFB_CONCAT2E(a,b) __RFB_CONCAT2(a,b)
 #endif
 
-#ifdef CPIXEL
+#ifndef __ZRLE_DECODE_SPANS
+#define __ZRLE_DECODE_SPANS
+
+// The tile decoders parse a span of bytes zis already holds, sp up to se,
+// with plain pointers. ZRLE_SPAN_NEED() goes back to zis for more only when
+// the span runs short; everything else a decoder does to zis must be
+// bracketed by ZRLE_SPAN_SYNC() and ZRLE_SPAN_RELOAD().
+
+#define ZRLE_SPAN_SYNC() zis->setptr(sp)
+#define ZRLE_SPAN_RELOAD() (sp = zis->getptr(), se = zis->getend())
+#define ZRLE_SPAN_NEED(n)                               \
+  if (se - sp < (n)) {                                  \
+    ZRLE_SPAN_SYNC();                                   \
+    zis->check(n);                                      \
+    ZRLE_SPAN_RELOAD();                                 \
+  }
+
+static inline U8 zrleSpanPixel8(const U8*& sp)
+{
+  return *sp++;
+}
+
+static inline U16 zrleSpanPixel16(const U8*& sp)
+{
+  U16 r; memcpy(&r, sp, 2); sp += 2; return r;
+}
+
+static inline U32 zrleSpanPixel32(const U8*& sp)
+{
+  U32 r; memcpy(&r, sp, 4); sp += 4; return r;
+}
+
+static inline U32 zrleSpanPixel24A(const U8*& sp)
+{
+  U32 r = 0; memcpy(&r, sp, 3); sp += 3; return r;
+}
+
+static inline U32 zrleSpanPixel24B(const U8*& sp)
+{
+  U32 r = 0; memcpy((U8*)&r + 1, sp, 3); sp += 3; return r;
+}
+
+// Read the length of a run, which may be split over more than one span.
+
+static inline int zrleSpanRunLength(rdr::InStream* zis, const U8*& sp,
+                                    const U8*& se)
+{
+  int len = 1;
+  int b;
+  do {
+    ZRLE_SPAN_NEED(1);
+    b = *sp++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Packed palette indices: entry [byte * (8 / bppp) + i] of zrleUnpack[bppp]
+// is the index of the i'th pixel in byte, most significant bits first.
+
+struct ZrleUnpackTables {
+  U8 bits1[256 * 8];
+  U8 bits2[256 * 4];
+  U8 bits4[256 * 2];
+  U8 bits8[256];
+  const U8* table[9];
+
+  ZrleUnpackTables() {
+    for (int byte = 0; byte < 256; byte++) {
+      for (int i = 0; i < 8; i++)
+        bits1[byte * 8 + i] = (byte >> (7 - i)) & 1;
+      for (int i = 0; i < 4; i++)
+        bits2[byte * 4 + i] = (byte >> (6 - i * 2)) & 3;
+      for (int i = 0; i < 2; i++)
+        bits4[byte * 2 + i] = (byte >> (4 - i * 4)) & 15;
+      bits8[byte] = byte & 127;
+    }
+    table[1] = bits1;
+    table[2] = bits2;
+    table[4] = bits4;
+    table[8] = bits8;
+  }
+};
+
+static const ZrleUnpackTables zrleUnpack;
+
+#endif
+
+#ifdef ZRLE_RGB24
 #define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
-#define READ_PIXEL __RFB_CONCAT2E(readOpaque,CPIXEL)
+#define READ_PIXEL __RFB_CONCAT2E(zrleSpanPixel,CPIXEL)
+#define PIXEL_SIZE 3
+#define ZRLE_DECODE_BPP __RFB_CONCAT2E(zrleDecodeRGB,CPIXEL)
+
+#ifndef __ZRLE_FILL_RGB24
+#define __ZRLE_FILL_RGB24
+
+// Fill n packed pixels with the first three bytes of pix.
+
+static inline void zrleFillRGB24(U8* dst, U32 pix, int n)
+{
+  const U8* p = (const U8*)&pix;
+
+  if (n < 8) {
+    for (U8* end = dst + n * 3; dst < end; dst += 3) {
+      dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[2];
+    }
+    return;
+  }
+
+  dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[2];
+  int done = 3;
+  int total = n * 3;
+  while (done * 2 <= total) {
+    memcpy(dst + done, dst, done);
+    done *= 2;
+  }
+  memcpy(dst + done, dst, total - done);
+}
+
+#endif
+
+#elif defined(CPIXEL)
+#define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
+#define READ_PIXEL __RFB_CONCAT2E(zrleSpanPixel,CPIXEL)
+#define PIXEL_SIZE 3
 #define ZRLE_DECODE_BPP __RFB_CONCAT2E(zrleDecode,CPIXEL)
 #else
 #define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
-#define READ_PIXEL __RFB_CONCAT2E(readOpaque,BPP)
+#define READ_PIXEL __RFB_CONCAT2E(zrleSpanPixel,BPP)
+#define PIXEL_SIZE (BPP / 8)
 #define ZRLE_DECODE_BPP __RFB_CONCAT2E(zrleDecode,BPP)
 #endif
 
-void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
-                      rdr::ZlibInStream* zis, PIXEL_T* buf)
+// Decodes the tiles of a rectangle from zis, which holds the uncompressed
+// ZRLE data - normally a ZlibInStream, but any InStream will do.
+
+void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* zis,
+#ifdef ZRLE_RGB24
+                      rdr::U8* fb, int stride)
+#else
+                      PIXEL_T* buf)
+#endif
 {
-  int length = is->readU32();
-  zis->setUnderlying(is, length);
+  const U8* sp;
+  const U8* se;
+
+  ZRLE_SPAN_RELOAD();
 
   for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
     int th = rfbZRLETileHeight;
@@ -62,17 +200,108 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
       int tw = rfbZRLETileWidth;
       if (tw > x+w-tx) tw = x+w-tx;
 
-      int mode = zis->readU8();
+      ZRLE_SPAN_NEED(1);
+      int mode = *sp++;
       bool rle = mode & 128;
       int palSize = mode & 127;
       PIXEL_T palette[128];
 
       //        fprintf(stderr,"rle %d palSize %d\n",rle,palSize);
 
+      ZRLE_SPAN_NEED(palSize * PIXEL_SIZE);
       for (int i = 0; i < palSize; i++) {
-        palette[i] = zis->READ_PIXEL();
+        palette[i] = READ_PIXEL(sp);
       }
 
+      int bppp = ((palSize > 16) ? 8 :
+                  ((palSize > 4) ? 4 : ((palSize > 2) ? 2 : 1)));
+      int pixelsPerByte = 8 / bppp;
+      int rowBytes = (tw * bppp + 7) / 8;
+      const U8* unpack = zrleUnpack.table[bppp];
+
+#ifdef ZRLE_RGB24
+
+      U8* tile = fb + (ty-y) * stride + (tx-x) * 3;
+
+      if (palSize == 1) {
+        zrleFillRGB24(tile, palette[0], tw);
+        for (int i = 1; i < th; i++)
+          memcpy(tile + i * stride, tile, tw * 3);
+        continue;
+      }
+
+      if (!rle) {
+        if (palSize == 0) {
+
+          // raw
+
+          ZRLE_SPAN_SYNC();
+          for (int i = 0; i < th; i++)
+            zis->readBytes(tile + i * stride, tw * 3);
+          ZRLE_SPAN_RELOAD();
+
+        } else {
+
+          // packed pixels
+
+          for (int i = 0; i < th; i++) {
+            U8* ptr = tile + i * stride;
+            U8* eol = ptr + tw * 3;
+
+            ZRLE_SPAN_NEED(rowBytes);
+            while (ptr < eol) {
+              const U8* index = unpack + *sp++ * pixelsPerByte;
+              for (int j = 0; j < pixelsPerByte && ptr < eol; j++) {
+                const U8* p = (const U8*)&palette[index[j]];
+                ptr[0] = p[0]; ptr[1] = p[1]; ptr[2] = p[2];
+                ptr += 3;
+              }
+            }
+          }
+        }
+        continue;
+      }
+
+      // plain or palette RLE; a run may carry on into the next row
+
+      U8* row = tile;
+      int col = 0;
+      int left = tw * th;
+      while (left > 0) {
+        PIXEL_T pix;
+        int len = 1;
+
+        if (palSize == 0) {
+          ZRLE_SPAN_NEED(PIXEL_SIZE);
+          pix = READ_PIXEL(sp);
+          len = zrleSpanRunLength(zis, sp, se);
+        } else {
+          ZRLE_SPAN_NEED(1);
+          int index = *sp++;
+          if (index & 128)
+            len = zrleSpanRunLength(zis, sp, se);
+          pix = palette[index & 127];
+        }
+
+        if (len > left)
+          throw rdr::Exception("ZRLE: run overflows tile");
+        left -= len;
+
+        while (len > 0) {
+          int n = tw - col;
+          if (n > len) n = len;
+          zrleFillRGB24(row + col * 3, pix, n);
+          len -= n;
+          col += n;
+          if (col == tw) {
+            col = 0;
+            row += stride;
+          }
+        }
+      }
+
+#else /* !ZRLE_RGB24 */
+
       if (palSize == 1) {
         PIXEL_T pix = palette[0];
         FILL_RECT(tx,ty,tw,th,pix);
@@ -85,34 +314,33 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           // raw
 
 #ifdef CPIXEL
-          for (PIXEL_T* ptr = buf; ptr < buf+tw*th; ptr++) {
-            *ptr = zis->READ_PIXEL();
+          PIXEL_T* ptr = buf;
+          for (int i = 0; i < th; i++) {
+            PIXEL_T* eol = ptr + tw;
+            ZRLE_SPAN_NEED(tw * PIXEL_SIZE);
+            while (ptr < eol)
+              *ptr++ = READ_PIXEL(sp);
           }
 #else
+          ZRLE_SPAN_SYNC();
           zis->readBytes(buf, tw * th * (BPP / 8));
+          ZRLE_SPAN_RELOAD();
 #endif
 
         } else {
 
           // packed pixels
-          int bppp = ((palSize > 16) ? 8 :
-                      ((palSize > 4) ? 4 : ((palSize > 2) ? 2 : 1)));
 
           PIXEL_T* ptr = buf;
 
           for (int i = 0; i < th; i++) {
             PIXEL_T* eol = ptr + tw;
-            U8 byte = 0;
-            U8 nbits = 0;
 
+            ZRLE_SPAN_NEED(rowBytes);
             while (ptr < eol) {
-              if (nbits == 0) {
-                byte = zis->readU8();
-                nbits = 8;
-              }
-              nbits -= bppp;
-              U8 index = (byte >> nbits) & ((1 << bppp) - 1) & 127;
-              *ptr++ = palette[index];
+              const U8* index = unpack + *sp++ * pixelsPerByte;
+              for (int j = 0; j < pixelsPerByte && ptr < eol; j++)
+                *ptr++ = palette[index[j]];
             }
           }
         }
@@ -131,13 +359,9 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           PIXEL_T* ptr = buf;
           PIXEL_T* end = ptr + th * tw;	    
           while (ptr < end) {
-            PIXEL_T pix = zis->READ_PIXEL();
-            int len = 1;
-            int b;
-            do {
-              b = zis->readU8();
-              len += b;
-            } while (b == 255);
+            ZRLE_SPAN_NEED(PIXEL_SIZE);
+            PIXEL_T pix = READ_PIXEL(sp);
+            int len = zrleSpanRunLength(zis, sp, se);
 
             assert(len <= end - ptr);
 
@@ -178,14 +402,11 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           PIXEL_T* ptr = buf;
           PIXEL_T* end = ptr + th * tw;
           while (ptr < end) {
-            int index = zis->readU8();
+            ZRLE_SPAN_NEED(1);
+            int index = *sp++;
             int len = 1;
             if (index & 128) {
-              int b;
-              do {
-                b = zis->readU8();
-                len += b;
-              } while (b == 255);
+              len = zrleSpanRunLength(zis, sp, se);
 
               assert(len <= end - ptr);
             }
@@ -230,12 +451,15 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
       //fprintf(stderr,"copying data to screen %dx%d at %d,%d\n",tw,th,tx,ty);
       IMAGE_RECT(tx,ty,tw,th,buf);
 #endif
+
+#endif /* ZRLE_RGB24 */
     }
   }
 
-  zis->reset();
+  ZRLE_SPAN_SYNC();
 }
 
 #undef ZRLE_DECODE_BPP
 #undef READ_PIXEL
+#undef PIXEL_SIZE
 #undef PIXEL_T
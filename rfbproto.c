@@ -37,6 +37,7 @@ static const char *ID = "$Id: rfbproto.c,v 1.7 2006/04/07 03:22:39 grmcdorman Ex
 #endif
 
 #include <errno.h>
+#include <time.h>
 
 #include "vncsnapshot.h"
 #include "vncauth.h"
@@ -46,11 +47,23 @@ static const char *ID = "$Id: rfbproto.c,v 1.7 2006/04/07 03:22:39 grmcdorman Ex
 #include <jpeglib.h>
 #undef INT16
 
-/* do not need non-32 bit versions of these */
+static Bool HandleRRE8(int rx, int ry, int rw, int rh);
+static Bool HandleRRE16(int rx, int ry, int rw, int rh);
 static Bool HandleRRE32(int rx, int ry, int rw, int rh);
+static Bool HandleCoRRE8(int rx, int ry, int rw, int rh);
+static Bool HandleCoRRE16(int rx, int ry, int rw, int rh);
 static Bool HandleCoRRE32(int rx, int ry, int rw, int rh);
+static Bool HandleHextile8(int rx, int ry, int rw, int rh);
+static Bool HandleHextile16(int rx, int ry, int rw, int rh);
 static Bool HandleHextile32(int rx, int ry, int rw, int rh);
+static Bool SkipHextile8(int rw, int rh);
+static Bool SkipHextile16(int rw, int rh);
+static Bool SkipHextile32(int rw, int rh);
+static Bool HandleZlib8(int rx, int ry, int rw, int rh);
+static Bool HandleZlib16(int rx, int ry, int rw, int rh);
 static Bool HandleZlib32(int rx, int ry, int rw, int rh);
+static Bool HandleTight8(int rx, int ry, int rw, int rh);
+static Bool HandleTight16(int rx, int ry, int rw, int rh);
 static Bool HandleTight32(int rx, int ry, int rw, int rh);
 
 static long ReadCompactLen (void);
@@ -60,8 +73,8 @@ static void JpegInitSource(j_decompress_ptr cinfo);
 static boolean JpegFillInputBuffer(j_decompress_ptr cinfo);
 static void JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes);
 static void JpegTermSource(j_decompress_ptr cinfo);
-static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
-                              int compressedLen);
+static void JpegSetSrcManager(j_decompress_ptr cinfo, int compressedLen);
+static Bool JpegDrainSource(void);
 
 char *desktopName;
 
@@ -98,6 +111,29 @@ Bool newServerCutText = False;
 
 int endianTest = 1;
 
+/* Framebuffer updates read to the end. */
+unsigned long updatesDecoded = 0;
+
+/*
+ * With decodeStats set, each rectangle is decoded to the end before the
+ * next is read, and the time and server data it took are added up by
+ * encoding for PrintDecodeStats().
+ */
+Bool decodeStats = False;
+
+typedef struct {
+  CARD32 encoding;
+  unsigned long rects;
+  double pixels, bytes, seconds;
+} EncodingStats;
+
+static EncodingStats encodingStats[MAX_ENCODINGS];
+static int numEncodingStats = 0;
+
+static double DecodeSeconds(void);
+static Bool CountDecodedRect(CARD32 encoding, double pixels, double start,
+			     unsigned long offset);
+
 
 /* note that the CoRRE encoding uses this buffer and assumes it is big enough
    to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes */
@@ -105,28 +141,30 @@ int endianTest = 1;
 #define BUFFER_SIZE (640*480)
 static char buffer[BUFFER_SIZE];
 
+/* RRE and CoRRE subrectangles are painted this many at a time. */
+#define SUBRECT_BATCH 1024
+static BufferSubrect subrects[SUBRECT_BATCH];
 
-/* The zlib encoding requires expansion/decompression/deflation of the
-   compressed data in the "buffer" above into another, result buffer.
-   However, the size of the result buffer can be determined precisely
-   based on the bitsPerPixel, height and width of the rectangle.  We
-   allocate this buffer one time to be the full size of the buffer. */
+/* Unused data is read past at most this many bytes at a time. */
+#define DISCARD_CHUNK 65536
 
-static int raw_buffer_size = -1;
-static char *raw_buffer;
+
+/* The zlib encoding inflates the compressed data straight from the input
+   buffer into "buffer" above, a few whole rows at a time, and copies each
+   batch of rows to the screen before inflating the next. */
 
 static z_stream decompStream;
 static Bool decompStreamInited = False;
 
+static Bool CopyZlibStream(z_streamp dst, Bool *dstActive,
+			   z_streamp src, Bool srcActive);
+static z_streamp DecoderStream(int stream, Bool **active);
+
 
 /*
  * Variables for the ``tight'' encoding implementation.
  */
 
-/* Separate buffer for compressed data. */
-#define ZLIB_BUFFER_SIZE 512
-static char zlib_buffer[ZLIB_BUFFER_SIZE];
-
 /* Four independent compression streams for zlib library. */
 static z_stream zlibStream[4];
 static Bool zlibStreamActive[4] = {
@@ -134,13 +172,48 @@ static Bool zlibStreamActive[4] = {
 };
 
 /* Filter stuff. Should be initialized by filter initialization code. */
-static Bool cutZeros;
-static int rectWidth, rectColors;
-static char tightPalette[256*4];
-static CARD8 tightPrevRow[2048*3*sizeof(CARD16)];
+typedef struct {
+  Bool cutZeros;
+  int rectWidth, rectColors;
+  CARD8 palette[256*sizeof(CARD32)];
+  CARD8 monoPixels[16*4*sizeof(CARD32)];
+} TightFilter;
 
-/* JPEG decoder state. */
+/*
+ * A rectangle of filtered, zlib-compressed data. Where decoding threads
+ * are available it is decoded by the thread for its zlib stream, with the
+ * compressed data copied in after the structure.
+ */
+typedef struct {
+  int rx, ry, rw, rh;
+  int streamId;
+  CARD8 filterId;
+  int bitsPixel;
+  TightFilter filter;
+  char *dst;			/* frame buffer, for unfiltered 24-bit data */
+  int stride;
+  int rowsDone, extraBytes;	/* progress so far */
+  int dataLen;
+} TightRect;
+
+/* Working storage of a decoding thread. */
+typedef struct {
+  char *buffer;			/* inflated data, BUFFER_SIZE bytes */
+  CARD8 *prevRow, *thisRow;	/* gradient filter state */
+  int rowBytes;
+} TightContext;
+
+/* Context for decoding on this thread; the stream threads have their own. */
+static TightContext tightContext = { buffer, NULL, NULL, 0 };
+static TightContext tightStreamContext[4];
+
+static Bool AllocateTightRows (TightContext *ctx, int rw);
+
+/* JPEG decoder state, kept for the whole session. */
 static Bool jpegError;
+static struct jpeg_decompress_struct jpegInfo;
+static struct jpeg_error_mgr jpegErrorMgr;
+static Bool jpegInfoCreated = False;
 
 
 /*
@@ -379,7 +452,8 @@ Bool SendSetEncodings()
 	requestLastRectEncoding = True;
 	if (appData.compressLevel >= 0 && appData.compressLevel <= 9)
 	  requestCompressLevel = True;
-	if (appData.enableJPEG)
+	/* There is no JPEG in 8 bpp mode. */
+	if (appData.enableJPEG && myFormat.bitsPerPixel != 8)
 	  requestQualityLevel = True;
       } else if (strncasecmp(encStr,"hextile",encStrLen) == 0) {
 	encs[se->nEncodings++] = Swap32IfLE(rfbEncodingHextile);
@@ -457,7 +531,7 @@ Bool SendSetEncodings()
       encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCompressLevel1);
     }
 
-    if (appData.enableJPEG) {
+    if (appData.enableJPEG && myFormat.bitsPerPixel != 8) {
       if (appData.qualityLevel < 0 || appData.qualityLevel > 9)
 	appData.qualityLevel = 5;
       encs[se->nEncodings++] = Swap32IfLE(appData.qualityLevel +
@@ -488,20 +562,94 @@ Bool SendSetEncodings()
 Bool
 SendIncrementalFramebufferUpdateRequest()
 {
-  return SendFramebufferUpdateRequest(0, 0, si.framebufferWidth,
-				      si.framebufferHeight, True);
+  return SendCaptureUpdateRequests(True);
 }
 
 Bool RequestNewUpdate()
 {
-  if (!SendFramebufferUpdateRequest(appData.rectX, appData.rectY, appData.rectWidth,
-                                      appData.rectHeight, True)) {
+  if (!SendCaptureUpdateRequests(True)) {
       return False;
   }
 
   return True;
 }
 
+/*
+ * Read past count items of size bytes the server sent without using them,
+ * a batch of items at a time, so that the total need not fit in a long.
+ */
+
+static Bool
+DiscardFromRFBServer(unsigned long count, unsigned long size)
+{
+  unsigned long batch = size < DISCARD_CHUNK ? DISCARD_CHUNK / size : 1;
+  unsigned long items, n;
+  char *data;
+  unsigned int got;
+
+  if (size == 0)
+    return True;
+  while (count > 0) {
+    items = count < batch ? count : batch;
+    count -= items;
+    for (n = items * size; n > 0; n -= got) {
+      got = PeekFromRFBServer(&data, 1, n < DISCARD_CHUNK ? n : DISCARD_CHUNK);
+      if (got == 0)
+	return False;
+      SkipFromRFBServer(got);
+    }
+  }
+  return True;
+}
+
+/*
+ * SkipRect reads past a rectangle outside every captured region, if its
+ * encoding allows that without decoding it. Encodings whose compression
+ * state carries over to later rectangles must still be decoded; the frame
+ * buffer discards what they write outside the regions.
+ */
+
+static Bool
+SkipRect(rfbFramebufferUpdateRectHeader *rect, Bool *skipped)
+{
+  unsigned long bytesPerPixel = myFormat.bitsPerPixel / 8;
+  rfbRREHeader hdr;
+
+  *skipped = True;
+  switch (rect->encoding) {
+  case rfbEncodingRaw:
+    return DiscardFromRFBServer(rect->r.h, rect->r.w * bytesPerPixel);
+  case rfbEncodingCopyRect:
+    return DiscardFromRFBServer(1, sz_rfbCopyRect);
+  case rfbEncodingRRE:
+  case rfbEncodingCoRRE:
+    if (!ReadFromRFBServer((char *)&hdr, sz_rfbRREHeader))
+      return False;
+    hdr.nSubrects = Swap32IfLE(hdr.nSubrects);
+    /* More subrectangles than pixels can only be corrupt data. */
+    if (hdr.nSubrects > (unsigned long)rect->r.w * rect->r.h) {
+      fprintf(stderr, "Incorrect data received from the server.\n");
+      return False;
+    }
+    return DiscardFromRFBServer(1, bytesPerPixel) &&
+      DiscardFromRFBServer(hdr.nSubrects, bytesPerPixel +
+			   (rect->encoding == rfbEncodingRRE ?
+			    sz_rfbRectangle : 4));
+  case rfbEncodingHextile:
+    switch (myFormat.bitsPerPixel) {
+    case 8:
+      return SkipHextile8(rect->r.w, rect->r.h);
+    case 16:
+      return SkipHextile16(rect->r.w, rect->r.h);
+    case 32:
+      return SkipHextile32(rect->r.w, rect->r.h);
+    }
+    break;
+  }
+  *skipped = False;
+  return True;
+}
+
 /*
  * HandleRFBServerMessage.
  */
@@ -510,6 +658,8 @@ Bool
 HandleRFBServerMessage()
 {
   rfbServerToClientMsg msg;
+  double rectStart = 0, rectPixels = 0;
+  unsigned long rectOffset = 0;
 
   if (!ReadFromRFBServer((char *)&msg, 1))
     return False;
@@ -534,6 +684,7 @@ HandleRFBServerMessage()
       return False;
 
     msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
+    CaptureUpdateStarted();
 
     for (i = 0; i < msg.fu.nRects; i++) {
       if (!ReadFromRFBServer((char *)&rect, sz_rfbFramebufferUpdateRectHeader))
@@ -545,6 +696,11 @@ HandleRFBServerMessage()
       rect.r.h = Swap16IfLE(rect.r.h);
 
       rect.encoding = Swap32IfLE(rect.encoding);
+      if (decodeStats) {
+	rectStart = DecodeSeconds();
+	rectOffset = RFBServerOffset();
+	rectPixels = (double)rect.r.w * rect.r.h;
+      }
 
       if (rect.encoding == rfbEncodingXCursor) {
 	if (!HandleCursorShape(rect.r.x, rect.r.y, rect.r.w, rect.r.h, rfbEncodingXCursor)) {
@@ -580,94 +736,181 @@ HandleRFBServerMessage()
 	continue;
       }
 
-      /* If RichCursor encoding is used, we should prevent collisions
-	 between framebuffer updates and cursor drawing operations. */
-      SoftCursorLockArea(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      CaptureRectReceived(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      if (!RectInCapture(rect.r.x, rect.r.y, rect.r.w, rect.r.h)) {
+	Bool skipped;
+
+	if (!SkipRect(&rect, &skipped))
+	  return False;
+	if (skipped)
+	  continue;
+      }
+
+      /* Tight and ZRLE queue their jobs behind any queued ones they
+	 overlap, or wait for those before decoding in place; everything
+	 else waits for all of them. */
+      if (rect.encoding != rfbEncodingTight &&
+	  rect.encoding != rfbEncodingZRLE && !WaitForDecodeJobs())
+	return False;
 
       switch (rect.encoding) {
 
       case rfbEncodingRaw:
 
+      {
+	char *data;
+
+	/* Convert whatever whole rows are already sitting in the socket
+	   buffer straight to the screen, rather than copying them through
+	   buffer[] first. */
 	bytesPerLine = rect.r.w * myFormat.bitsPerPixel / 8;
-	linesToRead = BUFFER_SIZE / bytesPerLine;
 
 	while (rect.r.h > 0) {
-	  if (linesToRead > rect.r.h)
-	    linesToRead = rect.r.h;
-
-	  if (!ReadFromRFBServer(buffer,bytesPerLine * linesToRead))
+	  linesToRead = PeekFromRFBServer(&data, bytesPerLine, rect.r.h);
+	  if (linesToRead == 0)
 	    return False;
-	  CopyDataToScreen(buffer, rect.r.x, rect.r.y, rect.r.w,
+
+	  CopyDataToScreen(data, rect.r.x, rect.r.y, rect.r.w,
 			   linesToRead);
+	  SkipFromRFBServer(bytesPerLine * linesToRead);
 
 	  rect.r.h -= linesToRead;
 	  rect.r.y += linesToRead;
 
 	}
 	break;
+      }
 
       case rfbEncodingCopyRect:
       {
 	rfbCopyRect cr;
-          char *buffer;
 
 	if (!ReadFromRFBServer((char *)&cr, sz_rfbCopyRect))
 	  return False;
 
           if (!BufferWritten()) {
             /* Ignore attempts to do copy-rect when we have nothing to
-             * copy from.
+             * copy from, and ask for the destination itself.
              */
+            if (!RequestCaptureRect(rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+              return False;
             break;
         }
 
  	cr.srcX = Swap16IfLE(cr.srcX);
 	cr.srcY = Swap16IfLE(cr.srcY);
 
-	/* If RichCursor encoding is used, we should extend our
-	   "cursor lock area" (previously set to destination
-	   rectangle) to the source rectangle as well. */
-	SoftCursorLockArea(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
+	if ((cr.srcX + rect.r.w > si.framebufferWidth) ||
+	    (cr.srcY + rect.r.h > si.framebufferHeight)) {
+	  fprintf(stderr,"CopyRect source too large: %dx%d at (%d, %d)\n",
+		  rect.r.w, rect.r.h, cr.srcX, cr.srcY);
+	  return False;
+	}
+
+        CopyBufferRect(cr.srcX, cr.srcY, rect.r.x, rect.r.y,
+                       rect.r.w, rect.r.h);
 
-        buffer = CopyScreenToData(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
-        CopyDataToScreen(buffer, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
-        free(buffer);
+	/* Only the captured part of the screen is held, so a source
+	   outside it was never received; ask for the destination. */
+	if (!RectInsideCapture(cr.srcX, cr.srcY, rect.r.w, rect.r.h) &&
+	    !RequestCaptureRect(rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+	  return False;
 
 	break;
       }
 
       case rfbEncodingRRE:
       {
-	if (!HandleRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	switch (myFormat.bitsPerPixel) {
+	case 8:
+	  if (!HandleRRE8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 16:
+	  if (!HandleRRE16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 32:
+	  if (!HandleRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return False;
+	  break;
+	}
 	break;
       }
 
       case rfbEncodingCoRRE:
       {
-	if (!HandleCoRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	  return False;
+	switch (myFormat.bitsPerPixel) {
+	case 8:
+	  if (!HandleCoRRE8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 16:
+	  if (!HandleCoRRE16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 32:
+	  if (!HandleCoRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	}
 	break;
       }
 
       case rfbEncodingHextile:
       {
-	if (!HandleHextile32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	switch (myFormat.bitsPerPixel) {
+	case 8:
+	  if (!HandleHextile8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return False;
+	  break;
+	case 16:
+	  if (!HandleHextile16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 32:
+	  if (!HandleHextile32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	}
 	break;
       }
 
       case rfbEncodingZlib:
       {
-	if (!HandleZlib32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	switch (myFormat.bitsPerPixel) {
+	case 8:
+	  if (!HandleZlib8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return False;
+	  break;
+	case 16:
+	  if (!HandleZlib16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 32:
+	  if (!HandleZlib32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	}
 	break;
      }
 
       case rfbEncodingTight:
       {
-	if (!HandleTight32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	switch (myFormat.bitsPerPixel) {
+	case 8:
+	  if (!HandleTight8(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return False;
+	  break;
+	case 16:
+	  if (!HandleTight16(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	case 32:
+	  if (!HandleTight32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return False;
+	  break;
+	}
 	break;
       }
 
@@ -682,12 +925,24 @@ HandleRFBServerMessage()
 	return False;
       }
 
-      /* Now we may discard "soft cursor locks". */
-      SoftCursorUnlockScreen();
+      if (decodeStats &&
+	  !CountDecodedRect(rect.encoding, rectPixels, rectStart, rectOffset))
+	return False;
 
         /* Done. Save the screen image. */
     }
 
+      if (!WaitForDecodeJobs())
+          return False;
+      updatesDecoded++;
+
+      if (appData.record)
+          return RecordUpdate();
+
+      /* Regions requested separately may arrive in separate updates. */
+      if (!CaptureComplete())
+          break;
+
       /* RealVNC sometimes returns an initial black screen. */
       if (BufferIsBlank() && appData.ignoreBlank) {
           if (!appData.quiet && appData.ignoreBlank != 1) {
@@ -765,6 +1020,20 @@ static inline void GET_PIXEL32(void *pix, CARD8 *ptr)
 #define CONCAT2(a,b) a##b
 #define CONCAT2E(a,b) CONCAT2(a,b)
 
+#define BPP 8
+#include "protocols/rre.c"
+#include "protocols/corre.c"
+#include "protocols/hextile.c"
+#include "protocols/zlib.c"
+#include "protocols/tight.c"
+#undef BPP
+#define BPP 16
+#include "protocols/rre.c"
+#include "protocols/corre.c"
+#include "protocols/hextile.c"
+#include "protocols/zlib.c"
+#include "protocols/tight.c"
+#undef BPP
 #define BPP 32
 #include "protocols/rre.c"
 #include "protocols/corre.c"
@@ -775,7 +1044,245 @@ static inline void GET_PIXEL32(void *pix, CARD8 *ptr)
 
 
 /*
- * PrintPixelFormat.
+ * The decoders' zlib streams, for replay checkpoints: SaveDecoderState()
+ * copies them between updates, RestoreDecoderState() puts a copy back and
+ * FreeDecoderState() frees it.
+ */
+typedef struct {
+  Bool zlibInited;
+  z_stream zlib;
+  Bool tightActive[4];
+  z_stream tight[4];
+  void *zrle;
+} DecoderState;
+
+void *
+SaveDecoderState(void)
+{
+  DecoderState *state = (DecoderState *) calloc(1, sizeof(DecoderState));
+  Bool ok;
+  int i;
+
+  if (state == NULL) {
+    fprintf(stderr, "%s: out of memory\n", programName);
+    return NULL;
+  }
+  ok = CopyZlibStream(&state->zlib, &state->zlibInited,
+		      &decompStream, decompStreamInited);
+  for (i = 0; i < 4 && ok; i++)
+    ok = CopyZlibStream(&state->tight[i], &state->tightActive[i],
+			&zlibStream[i], zlibStreamActive[i]);
+  if (ok)
+    state->zrle = SaveZrleState();
+  if (state->zrle == NULL) {
+    FreeDecoderState(state);
+    return NULL;
+  }
+  return state;
+}
+
+Bool
+RestoreDecoderState(void *saved)
+{
+  DecoderState *state = (DecoderState *) saved;
+  Bool ok;
+  int i;
+
+  ok = CopyZlibStream(&decompStream, &decompStreamInited,
+		      &state->zlib, state->zlibInited);
+  for (i = 0; i < 4; i++)
+    ok = CopyZlibStream(&zlibStream[i], &zlibStreamActive[i],
+			&state->tight[i], state->tightActive[i]) && ok;
+  return RestoreZrleState(state->zrle) && ok;
+}
+
+void
+FreeDecoderState(void *saved)
+{
+  DecoderState *state = (DecoderState *) saved;
+  int i;
+
+  if (state->zlibInited)
+    inflateEnd(&state->zlib);
+  for (i = 0; i < 4; i++) {
+    if (state->tightActive[i])
+      inflateEnd(&state->tight[i]);
+  }
+  if (state->zrle != NULL)
+    FreeZrleState(state->zrle);
+  free(state);
+}
+
+/*
+ * The decoders' zlib streams, for keyframes. Each zlib, tight and ZRLE
+ * rectangle ends with a Z_SYNC_FLUSH, so between updates a stream is at a
+ * block boundary and all the next rectangle needs from it is its window,
+ * the last 32K it inflated. DecoderDictionary() copies the window of
+ * stream, from 0 to DECODER_STREAMS - 1, to dict, and says whether the
+ * stream is in use; SetDecoderDictionary() starts the stream again as raw
+ * inflate with the window given.
+ */
+static z_streamp
+DecoderStream(int stream, Bool **active)
+{
+  if (stream == 0) {
+    *active = &decompStreamInited;
+    return &decompStream;
+  }
+  *active = &zlibStreamActive[stream - 1];
+  return &zlibStream[stream - 1];
+}
+
+Bool
+DecoderDictionary(int stream, Bool *active, char *dict, unsigned int *length)
+{
+  Bool *inUse;
+  z_streamp zs;
+  uInt n = 0;
+
+  if (stream == DECODER_STREAMS - 1)
+    return ZrleDictionary(active, dict, length);
+  zs = DecoderStream(stream, &inUse);
+  *active = *inUse;
+  *length = 0;
+  if (!*inUse)
+    return True;
+  if (inflateGetDictionary(zs, (Bytef *)dict, &n) != Z_OK) {
+    fprintf(stderr, "%s: cannot copy zlib stream\n", programName);
+    return False;
+  }
+  *length = n;
+  return True;
+}
+
+Bool
+SetDecoderDictionary(int stream, const char *dict, unsigned int length)
+{
+  Bool *active;
+  z_streamp zs;
+
+  if (stream == DECODER_STREAMS - 1)
+    return SetZrleDictionary(dict, length);
+  zs = DecoderStream(stream, &active);
+  if (*active)
+    inflateEnd(zs);
+  *active = False;
+  zs->zalloc = Z_NULL;
+  zs->zfree = Z_NULL;
+  zs->opaque = Z_NULL;
+  zs->next_in = Z_NULL;
+  zs->avail_in = 0;
+  if (inflateInit2(zs, -MAX_WBITS) != Z_OK) {
+    fprintf(stderr, "%s: cannot restore zlib stream\n", programName);
+    return False;
+  }
+  *active = True;
+  if (length > 0 &&
+      inflateSetDictionary(zs, (const Bytef *)dict, length) != Z_OK) {
+    fprintf(stderr, "%s: cannot restore zlib stream\n", programName);
+    return False;
+  }
+  return True;
+}
+
+/* Make dst a copy of src, or not in use if src is not. */
+static Bool
+CopyZlibStream(z_streamp dst, Bool *dstActive, z_streamp src, Bool srcActive)
+{
+  if (*dstActive)
+    inflateEnd(dst);
+  *dstActive = False;
+  if (!srcActive)
+    return True;
+  if (inflateCopy(dst, src) != Z_OK) {
+    fprintf(stderr, "%s: cannot copy zlib stream\n", programName);
+    return False;
+  }
+  *dstActive = True;
+  return True;
+}
+
+
+static double
+DecodeSeconds(void)
+{
+#ifdef WIN32
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* Finish a rectangle started at start, offset bytes into the server data. */
+static Bool
+CountDecodedRect(CARD32 encoding, double pixels, double start,
+		 unsigned long offset)
+{
+  EncodingStats *es;
+  int i;
+
+  if (!WaitForDecodeJobs())
+    return False;
+
+  for (i = 0; i < numEncodingStats; i++) {
+    if (encodingStats[i].encoding == encoding)
+      break;
+  }
+  if (i == numEncodingStats) {
+    if (numEncodingStats == MAX_ENCODINGS)
+      return True;
+    memset(&encodingStats[i], 0, sizeof(EncodingStats));
+    encodingStats[i].encoding = encoding;
+    numEncodingStats++;
+  }
+  es = &encodingStats[i];
+  es->rects++;
+  es->pixels += pixels;
+  es->bytes += RFBServerOffset() - offset;
+  es->seconds += DecodeSeconds() - start;
+  return True;
+}
+
+void
+PrintDecodeStats(FILE *f)
+{
+  static const struct {
+    CARD32 encoding;
+    const char *name;
+  } names[] = {
+    { rfbEncodingRaw, "raw" }, { rfbEncodingCopyRect, "copyrect" },
+    { rfbEncodingRRE, "rre" }, { rfbEncodingCoRRE, "corre" },
+    { rfbEncodingHextile, "hextile" }, { rfbEncodingZlib, "zlib" },
+    { rfbEncodingTight, "tight" }, { rfbEncodingZRLE, "zrle" }
+  };
+  int i, j;
+
+  fprintf(f, "%-9s %8s %10s %10s %9s %10s %10s\n", "encoding", "rects",
+	  "Mpixels", "MB", "seconds", "Mpixels/s", "MB/s");
+  for (i = 0; i < numEncodingStats; i++) {
+    EncodingStats *es = &encodingStats[i];
+    double secs = es->seconds > 0 ? es->seconds : 1e-9;
+
+    for (j = 0; j < (int)(sizeof(names) / sizeof(names[0])); j++) {
+      if (names[j].encoding == es->encoding)
+	break;
+    }
+    if (j < (int)(sizeof(names) / sizeof(names[0])))
+      fprintf(f, "%-9s", names[j].name);
+    else
+      fprintf(f, "%-9ld", (long)es->encoding);
+    fprintf(f, " %8lu %10.2f %10.2f %9.3f %10.2f %10.2f\n", es->rects,
+	    es->pixels / 1e6, es->bytes / 1e6, es->seconds,
+	    es->pixels / 1e6 / secs, es->bytes / 1e6 / secs);
+  }
+}
+
+
+/*
+ * PrintPixelFormat..
  */
 
 void
@@ -826,13 +1333,47 @@ ReadCompactLen (void)
   return len;
 }
 
+/*
+ * Make sure the Tight gradient filter's two row buffers can hold rw
+ * pixels of three CARD16 components each.
+ */
+
+static Bool
+AllocateTightRows (TightContext *ctx, int rw)
+{
+  int bytes = rw * 3 * sizeof(CARD16);
+
+  if (bytes <= ctx->rowBytes)
+    return True;
+
+  free(ctx->prevRow);
+  free(ctx->thisRow);
+  ctx->prevRow = malloc(bytes);
+  ctx->thisRow = malloc(bytes);
+  if (ctx->prevRow == NULL || ctx->thisRow == NULL) {
+    free(ctx->prevRow);
+    free(ctx->thisRow);
+    ctx->prevRow = ctx->thisRow = NULL;
+    ctx->rowBytes = 0;
+    fprintf(stderr, "Memory allocation error.\n");
+    return False;
+  }
+
+  ctx->rowBytes = bytes;
+  return True;
+}
+
 /*
  * JPEG source manager functions for JPEG decompression in Tight decoder.
+ * The compressed data is handed to libjpeg straight from the socket input
+ * buffer, as much at a time as has been received. jpegDataHeld bytes of
+ * it have been given to libjpeg but not yet skipped in the input buffer,
+ * and jpegDataLeft bytes of the rectangle remain to be read.
  */
 
 static struct jpeg_source_mgr jpegSrcManager;
-static JOCTET *jpegBufferPtr;
-static size_t jpegBufferLen;
+static int jpegDataLeft;
+static unsigned int jpegDataHeld;
 
 static void
 JpegInitSource(j_decompress_ptr cinfo)
@@ -843,9 +1384,26 @@ JpegInitSource(j_decompress_ptr cinfo)
 static boolean
 JpegFillInputBuffer(j_decompress_ptr cinfo)
 {
-  jpegError = True;
-  jpegSrcManager.bytes_in_buffer = jpegBufferLen;
-  jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+  char *data;
+
+  SkipFromRFBServer(jpegDataHeld);
+  jpegDataHeld = 0;
+
+  if (jpegDataLeft > 0)
+    jpegDataHeld = PeekFromRFBServer(&data, 1, jpegDataLeft);
+
+  if (jpegDataHeld == 0) {
+    /* Out of data: let libjpeg finish with an EOI marker. */
+    jpegError = True;
+    jpegSrcManager.next_input_byte = eoi;
+    jpegSrcManager.bytes_in_buffer = 2;
+    return TRUE;
+  }
+
+  jpegDataLeft -= jpegDataHeld;
+  jpegSrcManager.next_input_byte = (JOCTET *)data;
+  jpegSrcManager.bytes_in_buffer = jpegDataHeld;
 
   return TRUE;
 }
@@ -853,11 +1411,13 @@ JpegFillInputBuffer(j_decompress_ptr cinfo)
 static void
 JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes)
 {
-  if (num_bytes < 0 || (unsigned int) num_bytes > jpegSrcManager.bytes_in_buffer) {
-    jpegError = True;
-    jpegSrcManager.bytes_in_buffer = jpegBufferLen;
-    jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
-  } else {
+  while (num_bytes > (long)jpegSrcManager.bytes_in_buffer) {
+    num_bytes -= (long)jpegSrcManager.bytes_in_buffer;
+    JpegFillInputBuffer(cinfo);
+    if (jpegError)
+      return;
+  }
+  if (num_bytes > 0) {
     jpegSrcManager.next_input_byte += (size_t) num_bytes;
     jpegSrcManager.bytes_in_buffer -= (size_t) num_bytes;
   }
@@ -870,20 +1430,44 @@ JpegTermSource(j_decompress_ptr cinfo)
 }
 
 static void
-JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
-		  int compressedLen)
+JpegSetSrcManager(j_decompress_ptr cinfo, int compressedLen)
 {
-  jpegBufferPtr = (JOCTET *)compressedData;
-  jpegBufferLen = (size_t)compressedLen;
+  jpegDataLeft = compressedLen;
+  jpegDataHeld = 0;
 
   jpegSrcManager.init_source = JpegInitSource;
   jpegSrcManager.fill_input_buffer = JpegFillInputBuffer;
   jpegSrcManager.skip_input_data = JpegSkipInputData;
   jpegSrcManager.resync_to_restart = jpeg_resync_to_restart;
   jpegSrcManager.term_source = JpegTermSource;
-  jpegSrcManager.next_input_byte = jpegBufferPtr;
-  jpegSrcManager.bytes_in_buffer = jpegBufferLen;
+  jpegSrcManager.next_input_byte = NULL;
+  jpegSrcManager.bytes_in_buffer = 0;
 
   cinfo->src = &jpegSrcManager;
 }
 
+/*
+ * Skip whatever is left of the rectangle's compressed data once libjpeg
+ * is done with it, so that the next message is read from the right place.
+ */
+
+static Bool
+JpegDrainSource(void)
+{
+  char *data;
+  unsigned int len;
+
+  SkipFromRFBServer(jpegDataHeld);
+  jpegDataHeld = 0;
+
+  while (jpegDataLeft > 0) {
+    len = PeekFromRFBServer(&data, 1, jpegDataLeft);
+    if (len == 0)
+      return False;
+    SkipFromRFBServer(len);
+    jpegDataLeft -= len;
+  }
+
+  return True;
+}
+
@@ -48,16 +48,51 @@ extern "C" {
 
 #include <rdr/FdInStream.h>
 #include <rdr/FdOutStream.h>
+#include <rdr/MemInStream.h>
 #include <rdr/Exception.h>
 
 extern "C" { void PrintInHex(char *buf, int len); }
 
 
+/*
+ * The input buffer is large enough to hold a complete row of 32-bit pixels
+ * at the maximum RFB width (65535), so raw rectangles can always be
+ * converted a whole row at a time straight out of it.
+ */
+#define RFB_IN_BUFFER_SIZE (65536 * 4)
+
 int rfbsock;
 rdr::FdInStream* fis;
 rdr::FdOutStream* fos;
 Bool sameMachine = False;
 
+static void (*rfbTee)(void *, const void *, int) = 0;
+
+/* Server data comes from fis, or from memory when replaying a recording. */
+static rdr::InStream* rfbInStream = 0;
+static rdr::MemInStream* mis = 0;
+static const rdr::U8* misStart;
+
+/*
+ * While the C decoders run, rfbIn holds the current read position in
+ * rfbInStream's buffer. Any C++ code using the stream directly must
+ * bracket that use with GetRFBInStream() and ReleaseRFBInStream() so the
+ * two stay in step.
+ */
+RFBInBuffer rfbIn;
+
+rdr::InStream* GetRFBInStream()
+{
+  rfbInStream->setptr(rfbIn.ptr);
+  return rfbInStream;
+}
+
+void ReleaseRFBInStream()
+{
+  rfbIn.ptr = rfbInStream->getptr();
+  rfbIn.end = rfbInStream->getend();
+}
+
 /*static Bool rfbsockReady = False;*/
 
 /*
@@ -122,8 +157,11 @@ Bool SetRFBSock(int sock)
 {
   try {
     rfbsock = sock;
-    fis = new rdr::FdInStream(rfbsock);
+    fis = new rdr::FdInStream(rfbsock, 0, RFB_IN_BUFFER_SIZE);
     fos = new rdr::FdOutStream(rfbsock);
+    fis->setTee(rfbTee);
+    rfbInStream = fis;
+    ReleaseRFBInStream();
 
     struct sockaddr_in peeraddr, myaddr;
     socklen_t addrlen = sizeof(struct sockaddr_in);
@@ -140,15 +178,101 @@ Bool SetRFBSock(int sock)
   return False;
 }
 
-Bool ReadFromRFBServer(char *out, unsigned int n)
+/*
+ * SetRFBServerTee has everything read from the server from now on passed
+ * to tee as well, as it arrives; see record.c.
+ */
+
+void SetRFBServerTee(void (*tee)(void *arg, const void *data, int len))
+{
+  rfbTee = tee;
+  if (fis)
+    fis->setTee(rfbTee);
+}
+
+
+/*
+ * SetRFBServerData has the decoders read len bytes of server data at data
+ * instead of reading from a socket, to replay a recording. Nothing is
+ * sent to the server while replaying.
+ */
+
+Bool SetRFBServerData(const char *data, unsigned long len)
 {
+  if (len > 0x7fffffffUL) {
+    fprintf(stderr,"SetRFBServerData: %lu bytes is too much data\n", len);
+    return False;
+  }
+  delete mis;
+  mis = new rdr::MemInStream(data, (int)len);
+  misStart = (const rdr::U8*)data;
+  rfbInStream = mis;
+  ReleaseRFBInStream();
+  return True;
+}
+
+
+/*
+ * RFBServerOffset returns how many bytes of server data the decoders have
+ * used, since connecting or since the start of the data being replayed.
+ */
+
+unsigned long RFBServerOffset(void)
+{
+  if (rfbInStream == mis)
+    return rfbIn.ptr - misStart;
+  return fis->pos() + (rfbIn.ptr - fis->getptr());
+}
+
+
+/*
+ * FillFromRFBServer is the slow path of ReadFromRFBServer(), taken when
+ * rfbIn does not already hold all n bytes.
+ */
+
+Bool FillFromRFBServer(char *out, unsigned int n)
+{
+  Bool ok = False;
+
   try {
-    fis->readBytes(out, n);
-    return True;
+    GetRFBInStream()->readBytes(out, n);
+    ok = True;
   } catch (rdr::Exception& e) {
     fprintf(stderr,"ReadFromRFBServer: %s\n",e.str());
   }
-  return False;
+  ReleaseRFBInStream();
+  return ok;
+}
+
+
+/*
+ * PeekFromRFBServer makes whole items of server data available in the input
+ * buffer without copying them out. Between one and nItems items of itemSize
+ * bytes are buffered; *out is set to the first of them and the number
+ * available is returned, or 0 on error. The caller must consume the data
+ * with SkipFromRFBServer() before reading anything else.
+ */
+
+unsigned int PeekFromRFBServer(char **out, unsigned int itemSize,
+                               unsigned int nItems)
+{
+  if (nItems > RFB_IN_BUFFER_SIZE / itemSize)
+    nItems = RFB_IN_BUFFER_SIZE / itemSize;
+
+  if ((unsigned int)(rfbIn.end - rfbIn.ptr) < itemSize) {
+    try {
+      GetRFBInStream()->check(itemSize);
+    } catch (rdr::Exception& e) {
+      fprintf(stderr,"PeekFromRFBServer: %s\n",e.str());
+      nItems = 0;
+    }
+    ReleaseRFBInStream();
+  }
+
+  if (nItems > (unsigned int)(rfbIn.end - rfbIn.ptr) / itemSize)
+    nItems = (rfbIn.end - rfbIn.ptr) / itemSize;
+  *out = (char *)rfbIn.ptr;
+  return nItems;
 }
 
 
@@ -158,6 +282,9 @@ Bool ReadFromRFBServer(char *out, unsigned int n)
 
 Bool WriteToRFBServer(char *buf, int n)
 {
+  if (!fos)
+    return True;
+
   try {
     fos->writeBytes(buf, n);
     fos->flush();
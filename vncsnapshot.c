@@ -85,6 +85,21 @@ main(int argc, char **argv)
 
   GetArgsAndResources(argc, argv);
 
+  if (!SetOutputSizes(appData.outputSizes, appData.outputFilename)) exit(1);
+  if (numCaptureRegions > 1 && strcmp(appData.outputFilename, "-") == 0) {
+    fprintf(stderr, "%s: only one region can be written to standard output\n",
+	    programName);
+    exit(1);
+  }
+  if (appData.record) {
+    if (strcmp(appData.outputFilename, "-") == 0) {
+      fprintf(stderr, "%s: a recording cannot be written to standard output\n",
+	      programName);
+      exit(1);
+    }
+    if (!StartRecording(appData.outputFilename)) exit(1);
+  }
+
   /* Unless we accepted an incoming connection, make a TCP connection to the
      given VNC server */
 
@@ -96,6 +111,8 @@ main(int argc, char **argv)
 
   if (!InitialiseRFBConnection()) exit(1);
 
+  ResolveCaptureRegions();
+
   if (!AllocateBuffer()) exit(1);
 
   /* Tell the VNC server which pixel format and encodings we want to use */
@@ -103,6 +120,14 @@ main(int argc, char **argv)
   SendSetPixelFormat();
   SendSetEncodings();
 
+  /* Record updates until the recording is over; see record.c. */
+  if (appData.record) {
+    if (!WriteRecordingHeader() || !SendCaptureUpdateRequests(False))
+      exit(1);
+    while (HandleRFBServerMessage())
+      ;
+    return StopRecording() ? 0 : 1;
+  }
 
   /* Set up for mutiple images, if required */
   if (appData.count > 1) {
@@ -160,51 +185,7 @@ main(int argc, char **argv)
 
     /* Now enter the main loop, processing VNC messages. */
 
-    /*
-     * Negative X/Y implies from opposite edge.
-     */
-    if (appData.rectX < 0) {
-      appData.rectX = si.framebufferWidth + appData.rectX;
-    } else if (appData.rectXNegative) {
-      appData.rectX = si.framebufferWidth - appData.rectX - appData.rectWidth;
-    }
-    if (appData.rectY < 0) {
-      appData.rectY = si.framebufferHeight + appData.rectY;
-    } else if (appData.rectYNegative) {
-      appData.rectY = si.framebufferHeight - appData.rectY - appData.rectHeight;
-    }
-    if (appData.rectX >= si.framebufferWidth || appData.rectX < 0) {
-      fprintf(stderr, "%s: Requested rectangle x <%ld> is outside screen width <%d>, using 0\n",
-	      programName, appData.rectX, si.framebufferWidth);
-      appData.rectX = 0;
-    }
-    if (appData.rectY >= si.framebufferHeight || appData.rectY < 0) {
-      fprintf(stderr, "%s: Requested rectangle y <%ld> is outside screen height <%d>, using 0\n",
-	      programName, appData.rectY, si.framebufferHeight);
-      appData.rectY = 0;
-    }
-
-    /*
-     * Width/height of 0 means to edge.
-     */
-    if (appData.rectWidth == 0) {
-      appData.rectWidth = si.framebufferWidth - appData.rectX;
-    }
-    if (appData.rectHeight == 0) {
-      appData.rectHeight = si.framebufferHeight - appData.rectY;
-    }
-    if (appData.rectWidth <= 0 || appData.rectWidth > si.framebufferWidth - appData.rectX) {
-      fprintf(stderr, "%s: Requested rectangle width <%ld> plus offset <%ld> is wider than screen width <%d>, using %ld\n",
-	      programName, appData.rectWidth, appData.rectX, si.framebufferWidth, si.framebufferWidth - appData.rectX);
-      appData.rectWidth = si.framebufferWidth - appData.rectX;
-    }
-    if (appData.rectHeight <= 0 || appData.rectHeight > si.framebufferHeight - appData.rectY) {
-      fprintf(stderr, "%s: Requested rectangle height <%ld> plus offset <%ld> is wider than screen height <%d>, using %ld\n",
-	      programName, appData.rectHeight, appData.rectY, si.framebufferHeight, si.framebufferHeight - appData.rectY);
-      appData.rectHeight = si.framebufferHeight - appData.rectY;
-    }
-    if (!SendFramebufferUpdateRequest(appData.rectX, appData.rectY, appData.rectWidth,
-				      appData.rectHeight, False)) {
+    if (!SendCaptureUpdateRequests(False)) {
       exit(1);
     }
 
@@ -213,19 +194,28 @@ main(int argc, char **argv)
 	break;
     }
 
-    /* shrink buffer to requested rectangle */
-    ShrinkBuffer(appData.rectX, appData.rectY, appData.rectWidth, appData.rectHeight);
-    write_JPEG_file(filename, appData.saveQuality, appData.rectWidth, appData.rectHeight);
-    if (!appData.quiet) {
-      fprintf(stderr, "Image saved from %s %dx%d screen to ", vncServerName ? vncServerName : "(local host)",
-              si.framebufferWidth, si.framebufferHeight);
-      if (strcmp(filename, "-") == 0) {
-	fprintf(stderr, "- (stdout)");
-      } else {
-	fprintf(stderr, "%s", filename);
+    /* save the requested rectangles */
+    for (i = 0; i < numCaptureRegions; i++) {
+      CaptureRegion *r = &captureRegions[i];
+      char *name = r->name ? OutputFileName(filename, r->name) : filename;
+
+      if (name == NULL || !WriteSnapshot(name, r->x, r->y, r->width, r->height))
+	exit(1);
+      if (!appData.quiet) {
+	fprintf(stderr, "Image saved from %s %dx%d screen to ", vncServerName ? vncServerName : "(local host)",
+		si.framebufferWidth, si.framebufferHeight);
+	if (strcmp(name, "-") == 0) {
+	  fprintf(stderr, "- (stdout)");
+	} else {
+	  fprintf(stderr, "%s", name);
+	}
+	fprintf(stderr, " using %ldx%ld+%ld+%ld rectangle\n", r->width, r->height,
+		r->x, r->y);
       }
-      fprintf(stderr, " using %ldx%ld+%ld+%ld rectangle\n", appData.rectWidth, appData.rectHeight,
-              appData.rectX, appData.rectY);
+      if (name != filename)
+	free(name);
+    }
+    if (!appData.quiet) {
       if (appData.useRemoteCursor != -1 && !appData.gotCursorPos) {
 	if (appData.useRemoteCursor) {
 	  fprintf(stderr, "Warning: -cursor not supported by server, cursor may not be included in image.\n");
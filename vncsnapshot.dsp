@@ -103,6 +103,10 @@ SOURCE=.\d3des.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\decodejobs.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\getpass.c
 # End Source File
 # Begin Source File
@@ -111,6 +115,18 @@ SOURCE=.\listen.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\output.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\record.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\regions.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\rfbproto.c
 # End Source File
 # Begin Source File
@@ -31,6 +31,10 @@
 #include <unistd.h>
 #endif
 
+#if defined(__sun) || defined(sun)
+#include <sys/isa_defs.h>	/* _BIG_ENDIAN or _LITTLE_ENDIAN */
+#endif
+
 #include "rfb.h"
 
 extern int endianTest;
@@ -71,6 +75,12 @@ extern int endianTest;
   (DEFAULT_SSH_CMD " -f -L %L:%H:%R %G sleep 20")
 
 
+#ifdef _MSC_VER
+#define INLINE __inline
+#else
+#define INLINE inline
+#endif
+
 typedef char Bool;
 #ifndef True
 #define True 1
@@ -103,15 +113,15 @@ typedef struct {
 
   int quiet;
 
-  char rectXNegative; /* if non-zero, X or Y relative to opposite edge */
-  char rectYNegative;
-  long rectWidth;
-  long rectHeight;
-  long rectX;
-  long rectY;
   char gotCursorPos;
   int fps;
   int count;	/* number of snapshots to grab */
+  int bitsPerPixel;	/* pixel size requested from the server */
+  Bool grayscale;	/* keep and save luma only */
+  int scale;		/* keep every scale'th pixel: 1, 2, 4 or 8 */
+  char *outputSizes;	/* -sizes list, NULL to save one full-size image */
+  Bool tiled;		/* lay the frame buffer out in tiles */
+  Bool record;		/* record the session instead of saving images */
 } AppData;
 
 extern AppData appData;
@@ -129,32 +139,170 @@ extern void usage(void);
 extern void GetArgsAndResources(int argc, char **argv);
 
 /* buffer.c */
+
+/* A subrectangle of one colour, relative to the rectangle containing it. */
+typedef struct {
+  unsigned long pixel;
+  int x, y, w, h;
+} BufferSubrect;
+
+/*
+ * The pixel formats AllocateBuffer() asks for, one per -bpp: BGR233, RGB565
+ * in this host's byte order, and 32-bit pixels whose bytes in memory are
+ * red, green, blue and padding. myFormat is always one of these, so the
+ * decoders instantiated for each pixel size take the shifts and maxima
+ * from here, at compile time, instead of from myFormat.
+ */
+#define MY_RED_SHIFT_8    0
+#define MY_GREEN_SHIFT_8  3
+#define MY_BLUE_SHIFT_8   6
+#define MY_RED_MAX_8      7
+#define MY_GREEN_MAX_8    7
+#define MY_BLUE_MAX_8     3
+
+#define MY_RED_SHIFT_16   11
+#define MY_GREEN_SHIFT_16 5
+#define MY_BLUE_SHIFT_16  0
+#define MY_RED_MAX_16     31
+#define MY_GREEN_MAX_16   63
+#define MY_BLUE_MAX_16    31
+
+/* Which byte order the 32-bit shifts are for. Compilers that do not say
+   are recognised by the processor; -DMY_BIG_ENDIAN=0 or 1 overrides. */
+#ifndef MY_BIG_ENDIAN
+#if defined(__BYTE_ORDER__)
+#define MY_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(__BIG_ENDIAN__) || \
+      (defined(_BIG_ENDIAN) && !defined(_LITTLE_ENDIAN)) || \
+      defined(__sparc) || defined(__sparc__) || defined(__hppa) || \
+      defined(__hppa__) || defined(__m68k__) || defined(__s390__) || \
+      defined(_POWER) || defined(_IBMR2) || defined(__MIPSEB__) || \
+      defined(__ARMEB__)
+#define MY_BIG_ENDIAN 1
+#elif defined(__LITTLE_ENDIAN__) || \
+      (defined(_LITTLE_ENDIAN) && !defined(_BIG_ENDIAN)) || \
+      defined(WIN32) || defined(_WIN32) || defined(__i386) || \
+      defined(__i386__) || defined(__x86_64) || defined(__x86_64__) || \
+      defined(__amd64) || defined(__alpha) || defined(__alpha__) || \
+      defined(__ia64) || defined(__ia64__) || defined(__MIPSEL__) || \
+      defined(__ARMEL__) || defined(__aarch64__)
+#define MY_BIG_ENDIAN 0
+#else
+#error "Cannot tell this machine's byte order; define MY_BIG_ENDIAN as 0 or 1"
+#endif
+#endif
+
+#if MY_BIG_ENDIAN
+#define MY_RED_SHIFT_32   24
+#define MY_GREEN_SHIFT_32 16
+#define MY_BLUE_SHIFT_32  8
+#else
+#define MY_RED_SHIFT_32   0
+#define MY_GREEN_SHIFT_32 8
+#define MY_BLUE_SHIFT_32  16
+#endif
+#define MY_RED_MAX_32     0xFF
+#define MY_GREEN_MAX_32   0xFF
+#define MY_BLUE_MAX_32    0xFF
+
 extern int AllocateBuffer();
 extern void CopyDataToScreen(char *buffer, int x, int y, int w, int h);
-extern char *CopyScreenToData(int x, int y, int w, int h);
+extern void CopyScaledDataToScreen(char *buffer, int x, int y, int w, int h);
+extern void ConvertToBufferPixels(const char *src, int n, char *dst);
+extern void CopyBufferRect(int srcX, int srcY, int x, int y, int w, int h);
+extern char *DirectBufferRect(int x, int y, int w, int h, int *stride);
+extern void DirectBufferWritten(int x, int y, int w, int h);
 extern void FillBufferRectangle(int x, int y, int w, int h, unsigned long pixel);
-extern void ShrinkBuffer(long x, long y, long req_width, long req_height);
-extern void write_JPEG_file (char * filename, int quality, int width, int height);
+extern void FillBufferSubrects(int rx, int ry, int rw, int rh,
+                               const BufferSubrect *subrects, int n);
+extern char *BufferRectPixels(int x, int y, int w, int h, int *stride,
+                              int *width, int *height);
+extern void GetBufferRows(int x, int y, int w, int h, char *dst, int stride);
+extern int BufferComponents(void);
+extern void StoredBufferSize(int *width, int *height);
+extern void GetStoredBufferRow(int row, char *dst);
+extern void PutStoredBufferRow(int row, const char *src);
+extern void *SaveBufferState(void);
+extern void RestoreBufferState(void *state);
+extern void FreeBufferState(void *state);
+extern void write_JPEG_file (char * filename, int quality, int x, int y,
+                             int width, int height);
+extern void write_JPEG_image (char * filename, int quality, char *pixels,
+                              int stride, int components, int width, int height);
 extern int BufferIsBlank();
 extern int BufferWritten();
 
-/* colour.c */
-
-extern unsigned long BGR233ToPixel[];
-
-
 /* cursor.c */
 
 extern Bool HandleCursorShape(int xhot, int yhot, int width, int height, CARD32 enc);
 extern Bool HandleCursorPos(int x, int y);
-extern void SoftCursorLockArea(int x, int y, int w, int h);
-extern void SoftCursorUnlockScreen(void);
-extern void SoftCursorMove(int x, int y);
+extern Bool CursorRect(int *x, int *y, int *w, int *h);
+extern void DrawCursor(char *pixels, int stride, int fx, int fy, int nx, int ny);
+extern Bool CursorShape(int *hotX, int *hotY, int *width, int *height,
+			const char **pixels, const CARD8 **mask);
+extern Bool CursorPosition(int *x, int *y);
+extern Bool SetCursorShape(int hotX, int hotY, int width, int height,
+			   const char *pixels, const CARD8 *mask);
+extern void *SaveCursorState(void);
+extern Bool RestoreCursorState(void *state);
+extern void FreeCursorState(void *state);
+
+/* decodejobs.c */
+
+#define DECODE_QUEUES 4
+
+typedef Bool (*DecodeJobProc)(void *arg);
+
+extern Bool QueueDecodeJob(int queue, int x, int y, int w, int h,
+			   DecodeJobProc proc, void *arg);
+extern Bool DecodeThreadsAvailable(void);
+extern Bool WaitForDecodeRect(int x, int y, int w, int h);
+extern Bool WaitForDecodeQueue(int queue);
+extern Bool WaitForDecodeJobs(void);
 
 /* listen.c */
 
 extern void listenForIncomingConnections();
 
+/* output.c */
+
+extern Bool SetOutputSizes(char *list, char *filename);
+extern Bool WriteSnapshot(char *filename, int x, int y, int w, int h);
+extern char *OutputFileName(const char *filename, const char *token);
+
+/* record.c */
+
+extern Bool StartRecording(const char *filename);
+extern Bool WriteRecordingHeader(void);
+extern Bool RecordUpdate(void);
+extern Bool StopRecording(void);
+
+/* regions.c */
+
+typedef struct {
+  char *name;		/* inserted into the output file name; NULL for none */
+  char xNegative;	/* if non-zero, X or Y relative to opposite edge */
+  char yNegative;
+  long width;
+  long height;
+  long x;
+  long y;
+} CaptureRegion;
+
+extern CaptureRegion *captureRegions;
+extern int numCaptureRegions;
+
+extern Bool AddCaptureRegion(const CaptureRegion *region);
+extern void ResolveCaptureRegions(void);
+extern void CaptureBounds(int *x, int *y, int *w, int *h);
+extern Bool SendCaptureUpdateRequests(Bool incremental);
+extern Bool RequestCaptureRect(int x, int y, int w, int h);
+extern Bool RectInCapture(int x, int y, int w, int h);
+extern Bool RectInsideCapture(int x, int y, int w, int h);
+extern void CaptureUpdateStarted(void);
+extern void CaptureRectReceived(int x, int y, int w, int h);
+extern Bool CaptureComplete(void);
+
 /* rfbproto.c */
 
 extern Bool canUseCoRRE;
@@ -162,6 +310,8 @@ extern Bool canUseHextile;
 extern char *desktopName;
 extern rfbPixelFormat myFormat;
 extern rfbServerInitMsg si;
+extern unsigned long updatesDecoded;
+extern Bool decodeStats;
 extern char *serverCutText;
 extern Bool newServerCutText;
 
@@ -176,6 +326,18 @@ extern Bool SendPointerEvent(int x, int y, int buttonMask);
 extern Bool SendKeyEvent(CARD32 key, Bool down);
 extern Bool SendClientCutText(char *str, int len);
 extern Bool HandleRFBServerMessage();
+extern void *SaveDecoderState(void);
+extern Bool RestoreDecoderState(void *state);
+extern void FreeDecoderState(void *state);
+extern void PrintDecodeStats(FILE *f);
+
+/* zlib's, tight's four and ZRLE's; each window is at most 32K. */
+#define DECODER_STREAMS 6
+#define DECODER_DICTIONARY_SIZE 32768
+extern Bool DecoderDictionary(int stream, Bool *active, char *dict,
+			      unsigned int *length);
+extern Bool SetDecoderDictionary(int stream, const char *dict,
+				 unsigned int length);
 
 extern void PrintPixelFormat(rfbPixelFormat *format);
 
@@ -187,11 +349,16 @@ extern int rfbsock;
 extern Bool InitializeSockets(void);
 extern Bool ConnectToRFBServer(const char *hostname, int port);
 extern Bool SetRFBSock(int sock);
+extern void SetRFBServerTee(void (*tee)(void *arg, const void *data, int len));
+extern Bool SetRFBServerData(const char *data, unsigned long len);
+extern unsigned long RFBServerOffset(void);
 extern void StartTiming();
 extern void StopTiming();
 extern int KbitsPerSecond();
 extern int TimeWaitedIn100us();
-extern Bool ReadFromRFBServer(char *out, unsigned int n);
+extern Bool FillFromRFBServer(char *out, unsigned int n);
+extern unsigned int PeekFromRFBServer(char **out, unsigned int itemSize,
+                                      unsigned int nItems);
 extern Bool WriteToRFBServer(char *buf, int n);
 extern int ConnectToTcpAddr(const char* hostname, int port);
 extern int FindFreeTcpPort();
@@ -200,6 +367,34 @@ extern int AcceptTcpConnection(int listenSock);
 
 extern Bool StringToIPAddr(const char *str, unsigned int *addr);
 
+/*
+ * rfbIn is the window of server data currently buffered by sockets.cxx.
+ * The decoders take data straight out of it; only when it runs dry does
+ * ReadFromRFBServer() call FillFromRFBServer() to refill it from the
+ * socket.
+ */
+typedef struct {
+  const CARD8 *ptr;
+  const CARD8 *end;
+} RFBInBuffer;
+
+extern RFBInBuffer rfbIn;
+
+static INLINE Bool ReadFromRFBServer(char *out, unsigned int n)
+{
+  if ((unsigned int)(rfbIn.end - rfbIn.ptr) < n)
+    return FillFromRFBServer(out, n);
+  memcpy(out, rfbIn.ptr, n);
+  rfbIn.ptr += n;
+  return True;
+}
+
+/* Consume data made available by PeekFromRFBServer(). */
+static INLINE void SkipFromRFBServer(unsigned int n)
+{
+  rfbIn.ptr += n;
+}
+
 
 /* tunnel.c */
 
@@ -213,6 +408,11 @@ extern char *programName;
 
 /* zrle.cxx */
 extern Bool zrleDecode(int x, int y, int w, int h);
+extern void *SaveZrleState(void);
+extern Bool RestoreZrleState(void *state);
+extern void FreeZrleState(void *state);
+extern Bool ZrleDictionary(Bool *active, char *dict, unsigned int *length);
+extern Bool SetZrleDictionary(const char *dict, unsigned int length);
 
 /* getpass.c (win32) */
 #ifdef WIN32
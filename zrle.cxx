@@ -24,6 +24,7 @@
 
 #include <rdr/ZlibInStream.h>
 #include <rdr/FdInStream.h>
+#include <rdr/MemInStream.h>
 #include <rdr/Exception.h>
 
 extern "C" {
@@ -53,6 +54,9 @@ extern "C" {
 #include <rfb/zrleDecode.h>
 #define CPIXEL 24A
 #include <rfb/zrleDecode.h>
+#define ZRLE_RGB24
+#include <rfb/zrleDecode.h>
+#undef ZRLE_RGB24
 #undef CPIXEL
 #define CPIXEL 24B
 #include <rfb/zrleDecode.h>
@@ -63,53 +67,315 @@ extern "C" {
 #define BUFFER_SIZE (rfbZRLETileWidth * rfbZRLETileHeight * 4)
 static char buffer[BUFFER_SIZE];
 
-rdr::ZlibInStream zis;
-extern rdr::FdInStream* fis;
+// Size of the buffer ZRLE data is inflated into; 0 for the rdr default.
+#ifndef ZRLE_INFLATE_BUFFER_SIZE
+#define ZRLE_INFLATE_BUFFER_SIZE 0
+#endif
 
-Bool zrleDecode(int x, int y, int w, int h)
+rdr::ZlibInStream zis(ZRLE_INFLATE_BUFFER_SIZE);
+extern rdr::InStream* GetRFBInStream();
+extern void ReleaseRFBInStream();
+
+// The pixel formats zrleDecode is instantiated for.
+
+enum ZrleFormat { ZRLE_8, ZRLE_16, ZRLE_32, ZRLE_24A, ZRLE_24B };
+
+static ZrleFormat zrleFormat()
 {
-  try {
-    switch (myFormat.bitsPerPixel) {
-
-    case 8:
-      zrleDecode8( x,y,w,h,fis,&zis,(rdr::U8*)buffer);
-      break;
-
-    case 16:
-      zrleDecode16(x,y,w,h,fis,&zis,(rdr::U16*)buffer);
-      break;
-
-    case 32:
-      bool fitsInLS3Bytes
-        = ((myFormat.redMax   << myFormat.redShift)   < (1<<24) &&
-           (myFormat.greenMax << myFormat.greenShift) < (1<<24) &&
-           (myFormat.blueMax  << myFormat.blueShift)  < (1<<24));
-
-      bool fitsInMS3Bytes = (myFormat.redShift   > 7  &&
-                             myFormat.greenShift > 7  &&
-                             myFormat.blueShift  > 7);
-
-      if ((fitsInLS3Bytes && !myFormat.bigEndian) ||
-          (fitsInMS3Bytes && myFormat.bigEndian))
-      {
-        zrleDecode24A(x,y,w,h,fis,&zis,(rdr::U32*)buffer);
+  switch (myFormat.bitsPerPixel) {
+  case 8:
+    return ZRLE_8;
+  case 16:
+    return ZRLE_16;
+  }
+
+  bool fitsInLS3Bytes
+    = ((myFormat.redMax   << myFormat.redShift)   < (1<<24) &&
+       (myFormat.greenMax << myFormat.greenShift) < (1<<24) &&
+       (myFormat.blueMax  << myFormat.blueShift)  < (1<<24));
+
+  bool fitsInMS3Bytes = (myFormat.redShift   > 7  &&
+                         myFormat.greenShift > 7  &&
+                         myFormat.blueShift  > 7);
+
+  if ((fitsInLS3Bytes && !myFormat.bigEndian) ||
+      (fitsInMS3Bytes && myFormat.bigEndian))
+    return ZRLE_24A;
+  if ((fitsInLS3Bytes && myFormat.bigEndian) ||
+      (fitsInMS3Bytes && !myFormat.bigEndian))
+    return ZRLE_24B;
+  return ZRLE_32;
+}
+
+static void zrleDecodeTiles(ZrleFormat format, int x, int y, int w, int h,
+                            rdr::InStream* is, void* buf)
+{
+  switch (format) {
+  case ZRLE_8:
+    zrleDecode8(x,y,w,h,is,(rdr::U8*)buf);
+    break;
+  case ZRLE_16:
+    zrleDecode16(x,y,w,h,is,(rdr::U16*)buf);
+    break;
+  case ZRLE_24A:
+    {
+      // The frame buffer holds exactly the three bytes of a 24A pixel.
+      int stride;
+      rdr::U8* fb = (rdr::U8*)DirectBufferRect(x, y, w, h, &stride);
+      if (fb) {
+        zrleDecodeRGB24A(x,y,w,h,is,fb,stride);
+        DirectBufferWritten(x, y, w, h);
+        break;
       }
-      else if ((fitsInLS3Bytes && myFormat.bigEndian) ||
-               (fitsInMS3Bytes && !myFormat.bigEndian))
-      {
-        zrleDecode24B(x,y,w,h,fis,&zis,(rdr::U32*)buffer);
+      // A tiled or partly captured frame buffer may still take single
+      // tiles directly.
+      for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
+        int th = rfbZRLETileHeight;
+        if (th > y+h-ty) th = y+h-ty;
+        for (int tx = x; tx < x+w; tx += rfbZRLETileWidth) {
+          int tw = rfbZRLETileWidth;
+          if (tw > x+w-tx) tw = x+w-tx;
+          fb = (rdr::U8*)DirectBufferRect(tx, ty, tw, th, &stride);
+          if (fb) {
+            zrleDecodeRGB24A(tx,ty,tw,th,is,fb,stride);
+            DirectBufferWritten(tx, ty, tw, th);
+          } else {
+            zrleDecode24A(tx,ty,tw,th,is,(rdr::U32*)buf);
+          }
+        }
       }
-      else
-      {
-        zrleDecode32(x,y,w,h,fis,&zis,(rdr::U32*)buffer);
+    }
+    break;
+  case ZRLE_24B:
+    zrleDecode24B(x,y,w,h,is,(rdr::U32*)buf);
+    break;
+  case ZRLE_32:
+    zrleDecode32(x,y,w,h,is,(rdr::U32*)buf);
+    break;
+  }
+}
+
+//
+// With decoding threads, inflating stays on this thread but expanding the
+// tiles does not. Each row of tiles is copied out of the inflated stream
+// into a band, finding the end of every tile with a light parse of its
+// header and runs, and the band is decoded by a worker. Bands go round the
+// decode queues, so several are expanded at once while the next is being
+// inflated.
+//
+
+struct ZrleBand {
+  int x, y, w, h;
+  ZrleFormat format;
+  int length, size;
+  rdr::U8 data[1];
+};
+
+static ZrleBand* zrleBandAppend(ZrleBand* band, rdr::InStream* is, int n)
+{
+  if (band->length + n > band->size) {
+    int size = band->size * 2;
+    if (size < band->length + n)
+      size = band->length + n;
+    ZrleBand* grown = (ZrleBand*)realloc(band, sizeof(ZrleBand) + size);
+    if (!grown)
+      throw rdr::Exception("ZRLE: out of memory");
+    band = grown;
+    band->size = size;
+  }
+  is->readBytes(band->data + band->length, n);
+  band->length += n;
+  return band;
+}
+
+static ZrleBand* zrleBandAppendRun(ZrleBand* band, rdr::InStream* is,
+                                   int* len)
+{
+  int b;
+  do {
+    band = zrleBandAppend(band, is, 1);
+    b = band->data[band->length - 1];
+    *len += b;
+  } while (b == 255);
+  return band;
+}
+
+static ZrleBand* zrleBandAppendTile(ZrleBand* band, rdr::InStream* is,
+                                    int tw, int th, int cpixelSize)
+{
+  band = zrleBandAppend(band, is, 1);
+  int mode = band->data[band->length - 1];
+  bool rle = mode & 128;
+  int palSize = mode & 127;
+  int pixels = tw * th;
+
+  band = zrleBandAppend(band, is, palSize * cpixelSize);
+  if (palSize == 1)
+    return band;
+
+  if (!rle) {
+    if (palSize == 0)
+      return zrleBandAppend(band, is, pixels * cpixelSize);
+    int bppp = ((palSize > 16) ? 8 :
+                ((palSize > 4) ? 4 : ((palSize > 2) ? 2 : 1)));
+    return zrleBandAppend(band, is, th * ((tw * bppp + 7) / 8));
+  }
+
+  while (pixels > 0) {
+    int len = 1;
+    if (palSize == 0) {
+      band = zrleBandAppend(band, is, cpixelSize);
+      band = zrleBandAppendRun(band, is, &len);
+    } else {
+      band = zrleBandAppend(band, is, 1);
+      if (band->data[band->length - 1] & 128)
+        band = zrleBandAppendRun(band, is, &len);
+    }
+    if (len > pixels)
+      throw rdr::Exception("ZRLE: run overflows tile");
+    pixels -= len;
+  }
+  return band;
+}
+
+static Bool zrleDecodeBand(void* arg)
+{
+  ZrleBand* band = (ZrleBand*)arg;
+  rdr::U32 buf[rfbZRLETileWidth * rfbZRLETileHeight];
+  Bool ok = True;
+
+  try {
+    rdr::MemInStream mis(band->data, band->length);
+    zrleDecodeTiles(band->format, band->x, band->y, band->w, band->h,
+                    &mis, buf);
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+    ok = False;
+  }
+  free(band);
+  return ok;
+}
+
+static Bool zrleQueueBands(ZrleFormat format, int x, int y, int w, int h)
+{
+  static const int cpixelSizes[] = { 1, 2, 4, 3, 3 };
+  static int nextQueue = 0;
+  int cpixelSize = cpixelSizes[format];
+  Bool ok = True;
+
+  for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
+    int th = rfbZRLETileHeight;
+    if (th > y+h-ty) th = y+h-ty;
+
+    int size = w * th * cpixelSize / 4 + 256;
+    ZrleBand* band = (ZrleBand*)malloc(sizeof(ZrleBand) + size);
+    if (!band)
+      throw rdr::Exception("ZRLE: out of memory");
+    band->x = x;
+    band->y = ty;
+    band->w = w;
+    band->h = th;
+    band->format = format;
+    band->length = 0;
+    band->size = size;
+
+    try {
+      for (int tx = x; tx < x+w; tx += rfbZRLETileWidth) {
+        int tw = rfbZRLETileWidth;
+        if (tw > x+w-tx) tw = x+w-tx;
+        band = zrleBandAppendTile(band, &zis, tw, th, cpixelSize);
       }
-      break;
+    } catch (rdr::Exception&) {
+      free(band);
+      throw;
     }
 
+    if (!QueueDecodeJob(nextQueue, x, ty, w, th, zrleDecodeBand, band))
+      ok = False;
+    nextQueue = (nextQueue + 1) % DECODE_QUEUES;
+  }
+  return ok;
+}
+
+Bool zrleDecode(int x, int y, int w, int h)
+{
+  rdr::InStream* fis = GetRFBInStream();
+  Bool ok = True;
+
+  try {
+    ZrleFormat format = zrleFormat();
+    int length = fis->readU32();
+    zis.setUnderlying(fis, length);
+
+    if (DecodeThreadsAvailable() && h > rfbZRLETileHeight)
+      ok = zrleQueueBands(format, x, y, w, h);
+    else if (WaitForDecodeRect(x, y, w, h))
+      zrleDecodeTiles(format, x, y, w, h, &zis, buffer);
+    else
+      ok = False;
+
+    zis.reset();
+
   } catch (rdr::Exception& e) {
     fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+    ReleaseRFBInStream();
     return False;
   }
 
-  return True;
+  ReleaseRFBInStream();
+  return ok;
+}
+
+// The state of zis, for replay checkpoints; see SaveDecoderState().
+
+void* SaveZrleState()
+{
+  try {
+    return zis.copyState();
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+  }
+  return 0;
+}
+
+Bool RestoreZrleState(void* state)
+{
+  try {
+    zis.setState((z_stream_s*)state);
+    return True;
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+  }
+  return False;
+}
+
+void FreeZrleState(void* state)
+{
+  rdr::ZlibInStream::freeState((z_stream_s*)state);
+}
+
+// zis's window, for keyframes; see DecoderDictionary().
+
+Bool ZrleDictionary(Bool* active, char* dict, unsigned int* length)
+{
+  try {
+    int n = zis.getDictionary((rdr::U8*)dict);
+    *active = n >= 0;
+    *length = n >= 0 ? n : 0;
+    return True;
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+  }
+  return False;
+}
+
+Bool SetZrleDictionary(const char* dict, unsigned int length)
+{
+  try {
+    zis.setDictionary((const rdr::U8*)dict, length);
+    return True;
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+  }
+  return False;
 }